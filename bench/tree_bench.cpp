@@ -0,0 +1,408 @@
+// tree_bench: builds synthetic directory trees and times the tree binary on
+// them. Every (shape, mode) pair is run a few times after one warm-up run;
+// each result is printed as one JSON object per line on stdout so runs can
+// be diffed or loaded into a spreadsheet. Entry and syscall counts come from
+// the binary's own -v report, peak RSS from wait4(). The render modes read a
+// snapshot of the shape saved beforehand, which leaves the formatting cost
+// without the syscalls around it.
+//
+//   tree_bench [--tree PATH] [--shape NAME]... [--scale N] [--runs N]
+//              [--dir PATH] [--keep] [--help]
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+#ifndef TREE_BINARY
+#define TREE_BINARY "tree"
+#endif
+
+struct BenchOptions {
+    std::string tree = TREE_BINARY;
+    std::vector<std::string> shapes;
+    int scale = 1;
+    int runs = 5;
+    std::string dir;   // where the trees are generated; a temp dir by default
+    bool keep = false; // leave the generated trees behind
+};
+
+// Writes the synthetic trees. File sizes are set with ftruncate, so even the
+// large ones cost no disk space; names carry a handful of extensions so
+// that -P '*.txt' matches about a quarter of the files.
+class TreeGenerator {
+public:
+    explicit TreeGenerator(uint64_t seed) : state(seed) {}
+
+    bool generate(const std::string& shape, const std::string& root, int scale) {
+        if (!make_dir(root)) return false;
+        if (shape == "wide") return wide(root, scale);
+        if (shape == "deep") return deep(root, scale);
+        if (shape == "small") return small(root, scale);
+        if (shape == "hidden") return hidden(root, scale);
+        if (shape == "symlinks") return symlinks(root, scale);
+        std::cerr << "Error: unknown shape " << shape << std::endl;
+        return false;
+    }
+
+private:
+    uint64_t state;
+
+    uint64_t next() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+
+    // Mostly small files, with a tail of larger ones for -S and -s.
+    uint64_t next_size() {
+        uint64_t roll = next() % 100;
+        if (roll < 70) return next() % 4096;
+        if (roll < 95) return 4096 + next() % (60 * 1024);
+        return 64 * 1024 + next() % (4 * 1024 * 1024);
+    }
+
+    std::string file_name(size_t index, bool hidden = false) {
+        static const char* extensions[] = {".txt", ".log", ".bin", ".c"};
+        std::string name = hidden ? "." : "";
+        name += "file" + std::to_string(index) + extensions[next() % 4];
+        return name;
+    }
+
+    static bool make_dir(const std::string& path) {
+        if (mkdir(path.c_str(), 0755) == 0 || errno == EEXIST) return true;
+        std::cerr << "Error: cannot create " << path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    bool make_file(const std::string& path) {
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            std::cerr << "Error: cannot create " << path << ": " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        bool ok = ftruncate(fd, static_cast<off_t>(next_size())) == 0;
+        close(fd);
+        return ok;
+    }
+
+    bool make_files(const std::string& dir, size_t count, bool some_hidden = false) {
+        for (size_t i = 0; i < count; ++i) {
+            bool hidden = some_hidden && (next() & 1);
+            if (!make_file(dir + "/" + file_name(i, hidden))) return false;
+        }
+        return true;
+    }
+
+    // One directory holding many files.
+    bool wide(const std::string& root, int scale) {
+        return make_files(root, 20000 * static_cast<size_t>(scale));
+    }
+
+    // Long chains of single subdirectories with a few files on each level.
+    bool deep(const std::string& root, int scale) {
+        for (int chain = 0; chain < 20 * scale; ++chain) {
+            std::string path = root + "/chain" + std::to_string(chain);
+            for (int level = 0; level < 64; ++level) {
+                if (!make_dir(path) || !make_files(path, 2)) return false;
+                path += "/level" + std::to_string(level);
+            }
+        }
+        return true;
+    }
+
+    // A balanced tree of many directories with small files in each.
+    bool small(const std::string& root, int scale) {
+        return small_level(root, 3, 40 * static_cast<size_t>(scale));
+    }
+
+    bool small_level(const std::string& dir, int levels, size_t files) {
+        if (!make_files(dir, files)) return false;
+        if (levels == 0) return true;
+        for (int i = 0; i < 8; ++i) {
+            std::string sub = dir + "/dir" + std::to_string(i);
+            if (!make_dir(sub) || !small_level(sub, levels - 1, files)) return false;
+        }
+        return true;
+    }
+
+    // About half of all names, directories included, start with a dot.
+    bool hidden(const std::string& root, int scale) {
+        for (int i = 0; i < 100 * scale; ++i) {
+            std::string sub = root + "/" + ((next() & 1) ? "." : "") + "dir" + std::to_string(i);
+            if (!make_dir(sub) || !make_files(sub, 50, true)) return false;
+        }
+        return make_files(root, 200, true);
+    }
+
+    // Directories full of links to files, to directories and to nothing.
+    bool symlinks(const std::string& root, int scale) {
+        std::string targets = root + "/targets";
+        if (!make_dir(targets) || !make_files(targets, 2000)) return false;
+        for (int i = 0; i < 100; ++i) {
+            if (!make_dir(targets + "/dir" + std::to_string(i))) return false;
+        }
+
+        std::vector<std::string> names;
+        for (const auto& item : fs::directory_iterator(targets)) {
+            names.push_back(item.path().filename().string());
+        }
+        std::sort(names.begin(), names.end());
+
+        for (int farm = 0; farm < 10 * scale; ++farm) {
+            std::string dir = root + "/farm" + std::to_string(farm);
+            if (!make_dir(dir)) return false;
+            for (int i = 0; i < 1000; ++i) {
+                std::string target = "../targets/";
+                if (next() % 10 == 0) {
+                    target += "missing" + std::to_string(i);
+                } else {
+                    target += names[next() % names.size()];
+                }
+                std::string link = dir + "/link" + std::to_string(i);
+                if (symlink(target.c_str(), link.c_str()) != 0) {
+                    std::cerr << "Error: cannot create " << link << ": "
+                              << std::strerror(errno) << std::endl;
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+};
+
+struct Mode {
+    const char* name;
+    std::vector<std::string> args;
+    bool from_snapshot = false; // render a --save of the shape, so only formatting is timed
+};
+
+const std::vector<Mode> MODES = {
+    {"plain", {}},
+    {"no_color", {"-n"}},
+    {"size_perms", {"-s", "-p"}},
+    {"glob", {"-P", "*.txt"}},
+    {"size_range", {"-S", "1K:64K"}},
+    {"dirs_only", {"-d"}},
+    {"all", {"-a"}},
+    {"render", {}, true},
+    {"render_no_color", {"-n"}, true},
+    {"render_size_perms", {"-s", "-p"}, true},
+};
+
+const std::vector<std::string> SHAPES = {"wide", "deep", "small", "hidden", "symlinks"};
+
+struct RunResult {
+    bool ok = false;
+    double seconds = 0;
+    long peak_rss_kb = 0;
+    unsigned long long entries = 0;
+    unsigned long long dirs_opened = 0;
+    unsigned long long stat_calls = 0;
+    unsigned long long readlink_calls = 0;
+};
+
+// Runs `tree -v <args> <dir>` with stdout on /dev/null and picks the
+// syscall counts out of what it prints on stderr.
+RunResult run_tree(const std::string& tree, const std::vector<std::string>& args,
+                   const std::string& dir) {
+    RunResult result;
+    int err_pipe[2];
+    if (pipe(err_pipe) != 0) return result;
+
+    std::vector<std::string> argv_strings = {tree, "-v"};
+    argv_strings.insert(argv_strings.end(), args.begin(), args.end());
+    argv_strings.push_back(dir);
+    std::vector<char*> argv;
+    for (auto& arg : argv_strings) argv.push_back(&arg[0]);
+    argv.push_back(nullptr);
+
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid < 0) return result;
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(err_pipe[1], STDERR_FILENO);
+        close(err_pipe[0]);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+    close(err_pipe[1]);
+
+    std::string errors;
+    char buffer[4096];
+    ssize_t len;
+    while ((len = read(err_pipe[0], buffer, sizeof(buffer))) > 0) {
+        errors.append(buffer, static_cast<size_t>(len));
+    }
+    close(err_pipe[0]);
+
+    int status = 0;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0) return result;
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.peak_rss_kb = usage.ru_maxrss;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        std::cerr << "Error: " << tree << " failed on " << dir << std::endl;
+        return result;
+    }
+
+    size_t line = errors.find(" entries read");
+    if (line != std::string::npos) {
+        line = errors.rfind('\n', line);
+        line = line == std::string::npos ? 0 : line + 1;
+        result.ok = sscanf(errors.c_str() + line,
+                           "%llu entries read, %llu directories opened, %llu stat calls (%*f per entry), "
+                           "%llu readlink calls",
+                           &result.entries, &result.dirs_opened, &result.stat_calls,
+                           &result.readlink_calls) == 4;
+    }
+    if (!result.ok) {
+        std::cerr << "Error: cannot parse the -v report of " << tree << " on " << dir << std::endl;
+    }
+    return result;
+}
+
+void print_result(const std::string& shape, const Mode& mode, std::vector<RunResult>& runs) {
+    std::sort(runs.begin(), runs.end(),
+              [](const RunResult& a, const RunResult& b) { return a.seconds < b.seconds; });
+    const RunResult& best = runs.front();
+    double median = runs[runs.size() / 2].seconds;
+    long peak_rss_kb = 0;
+    for (const auto& run : runs) peak_rss_kb = std::max(peak_rss_kb, run.peak_rss_kb);
+
+    unsigned long long syscalls = best.dirs_opened + best.stat_calls + best.readlink_calls;
+    double entries = static_cast<double>(best.entries);
+    std::string args;
+    for (const auto& arg : mode.args) args += (args.empty() ? "" : " ") + arg;
+    if (mode.from_snapshot) args += args.empty() ? "--fromfile" : " --fromfile";
+
+    printf("{\"shape\":\"%s\",\"mode\":\"%s\",\"args\":\"%s\",\"runs\":%zu,"
+           "\"entries\":%llu,\"seconds_min\":%.6f,\"seconds_median\":%.6f,"
+           "\"entries_per_sec\":%.0f,\"dirs_opened\":%llu,\"stat_calls\":%llu,"
+           "\"readlink_calls\":%llu,\"syscalls_per_entry\":%.4f,\"peak_rss_kb\":%ld}\n",
+           shape.c_str(), mode.name, args.c_str(), runs.size(),
+           best.entries, best.seconds, median,
+           best.seconds > 0 ? entries / best.seconds : 0.0,
+           best.dirs_opened, best.stat_calls, best.readlink_calls,
+           entries > 0 ? syscalls / entries : 0.0, peak_rss_kb);
+    fflush(stdout);
+}
+
+void print_usage(std::ostream& out) {
+    out << "Usage: tree_bench [OPTIONS]\n"
+        << "Options:\n"
+        << "  --help          show this help and exit\n"
+        << "  --tree <path>   tree binary to measure (default: " TREE_BINARY ")\n"
+        << "  --shape <name>  wide, deep, small, hidden or symlinks (repeatable;\n"
+        << "                  default: all of them)\n"
+        << "  --scale <n>     multiply the size of every shape by n (default 1)\n"
+        << "  --runs <n>      timed runs per mode after one warm-up (default 5)\n"
+        << "  --dir <path>    generate the trees here instead of a temp dir\n"
+        << "  --keep          do not delete the generated trees\n";
+}
+
+int main(int argc, char* argv[]) {
+    BenchOptions opts;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--help") {
+            print_usage(std::cout);
+            return 0;
+        } else if (arg == "--keep") {
+            opts.keep = true;
+        } else if (arg == "--tree" && has_value) {
+            opts.tree = argv[++i];
+        } else if (arg == "--shape" && has_value) {
+            opts.shapes.push_back(argv[++i]);
+        } else if (arg == "--scale" && has_value) {
+            opts.scale = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--runs" && has_value) {
+            opts.runs = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--dir" && has_value) {
+            opts.dir = argv[++i];
+        } else {
+            print_usage(std::cerr);
+            return 1;
+        }
+    }
+    if (opts.shapes.empty()) opts.shapes = SHAPES;
+
+    bool temporary = opts.dir.empty();
+    if (temporary) {
+        char templ[] = "/tmp/tree_bench.XXXXXX";
+        if (!mkdtemp(templ)) {
+            std::cerr << "Error: cannot create a temp dir: " << std::strerror(errno) << std::endl;
+            return 1;
+        }
+        opts.dir = templ;
+    }
+
+    int status = 0;
+    TreeGenerator generator(0x9e3779b97f4a7c15ULL);
+    for (const auto& shape : opts.shapes) {
+        std::string root = opts.dir + "/" + shape;
+        if (!generator.generate(shape, root, opts.scale)) {
+            status = 1;
+            break;
+        }
+        std::string snapshot = root + ".snap";
+        if (!run_tree(opts.tree, {"--save", snapshot}, root).ok) {
+            status = 1;
+            break;
+        }
+        for (const auto& mode : MODES) {
+            std::vector<std::string> args = mode.args;
+            if (mode.from_snapshot) {
+                args.push_back("--fromfile");
+                args.push_back(snapshot);
+            }
+            // A failed run, the warm-up included, ends the bench; the runs
+            // that did finish are not reported as the mode's result.
+            if (!run_tree(opts.tree, args, root).ok) { // warm the caches
+                status = 1;
+                break;
+            }
+            std::vector<RunResult> runs;
+            for (int run = 0; run < opts.runs; ++run) {
+                RunResult result = run_tree(opts.tree, args, root);
+                if (!result.ok) {
+                    status = 1;
+                    break;
+                }
+                runs.push_back(result);
+            }
+            if (status != 0) break;
+            print_result(shape, mode, runs);
+        }
+        if (status != 0) break;
+    }
+
+    // Only what was generated goes; a --dir given by the user stays.
+    if (!opts.keep) {
+        std::error_code error;
+        if (temporary) {
+            fs::remove_all(opts.dir, error);
+        } else {
+            for (const auto& shape : opts.shapes) {
+                fs::remove_all(opts.dir + "/" + shape, error);
+                fs::remove(opts.dir + "/" + shape + ".snap", error);
+            }
+        }
+    }
+    return status;
+}
@@ -0,0 +1,77 @@
+#!/bin/sh
+# --cache must print what a run without it prints, reuse the listings of
+# directories that did not change, read again those that did, and drop the
+# records of directories that are gone.
+# Usage: cache.sh <tree binary>
+set -eu
+tree=$1
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+mkdir -p "$work/root/a/b" "$work/root/c"
+echo one > "$work/root/a/one.txt"
+echo two > "$work/root/a/b/two.txt"
+echo three > "$work/root/c/three.txt"
+ln -s a/one.txt "$work/root/link"
+
+status=0
+fail() {
+    echo "FAIL: $*"
+    status=1
+}
+
+# Listings changed in the second before a run starts are not stored.
+settle() { sleep 2; }
+
+# run <name>: a cached run, checked against an uncached one; leaves the
+# "cache: ..." line in $work/<name>.report.
+run() {
+    "$tree" -n -s -p "$work/root" > "$work/expected"
+    "$tree" -n -s -p --cache "$work/cache" "$work/root" > "$work/$1.out" 2> "$work/$1.err"
+    grep '^cache:' "$work/$1.err" > "$work/$1.report" || true
+    if ! cmp -s "$work/expected" "$work/$1.out"; then
+        fail "$1 run differs from a run without --cache"
+        diff "$work/expected" "$work/$1.out" || true
+    fi
+}
+
+expect_report() {
+    if [ "$(cat "$work/$1.report")" != "$2" ]; then
+        fail "$1 run reported '$(cat "$work/$1.report")', expected '$2'"
+    fi
+}
+
+# Listings in the cache file: the count after the 8-byte magic and the
+# 4-byte version.
+records() {
+    od -An -t u8 -j 12 -N 8 "$work/cache/tree.cache" | tr -d ' '
+}
+
+settle
+run cold
+expect_report cold "cache: 0 of 4 directories reused (0.0% hit rate)"
+[ "$(records)" = 4 ] || fail "cold run stored $(records) listings, expected 4"
+
+run warm
+expect_report warm "cache: 4 of 4 directories reused (100.0% hit rate)"
+
+# A new file changes a's listing; only a is read again.
+echo four > "$work/root/a/four.txt"
+settle
+run rewrite
+expect_report rewrite "cache: 3 of 4 directories reused (75.0% hit rate)"
+if ! grep -q 'four.txt' "$work/rewrite.out"; then
+    fail "rewrite run does not show the new file"
+fi
+
+run rewarm
+expect_report rewarm "cache: 4 of 4 directories reused (100.0% hit rate)"
+
+# Removing b drops its record, not just the entry in a.
+rm -r "$work/root/a/b"
+settle
+run prune
+expect_report prune "cache: 2 of 3 directories reused (66.7% hit rate)"
+[ "$(records)" = 3 ] || fail "cache kept $(records) listings after b was removed, expected 3"
+
+exit $status
@@ -0,0 +1,34 @@
+#!/bin/sh
+# A --save or --fromfile render must print what the live run prints, also
+# when -D cuts off entries that -P, -S or --du decide on.
+# Usage: snapshot_depth.sh <tree binary>
+set -eu
+tree=$1
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+mkdir -p "$work/root/a/b/c" "$work/root/x/y"
+echo 'int main;' > "$work/root/a/b/c/main.c"
+head -c 3000 /dev/zero > "$work/root/x/y/big"
+echo small > "$work/root/a/note"
+
+status=0
+check() {
+    name=$1
+    shift
+    "$tree" -n -D 2 "$@" "$work/root" > "$work/live"
+    "$tree" -n -D 2 "$@" --save "$work/snap" "$work/root" > "$work/saved"
+    "$tree" -n -D 2 "$@" --fromfile "$work/snap" > "$work/loaded"
+    for out in saved loaded; do
+        if ! cmp -s "$work/live" "$work/$out"; then
+            echo "FAIL: -D 2 $name, $out run differs from the live run"
+            diff "$work/live" "$work/$out" || true
+            status=1
+        fi
+    done
+}
+
+check "-P" -P '*.c'
+check "-S" -S 2K
+check "--du" --du
+exit $status
@@ -0,0 +1,285 @@
+// Checks for the parts of tree_walker.h the CLI tests only reach through
+// whole runs: -P/-I matching, .gitignore rules, JSON string escaping and
+// the --dupes finder. Every failed check is printed; the exit status is 1
+// if there was any.
+#include "tree_walker.h"
+
+#include <cstdio>
+#include <initializer_list>
+
+using namespace tree_walker;
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(cond)                                                                 \
+    do {                                                                            \
+        if (!(cond)) {                                                              \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                             \
+        }                                                                           \
+    } while (0)
+
+// --- GlobSet ---------------------------------------------------------------
+
+struct Pattern {
+    const char* text;
+    GlobSet::Kind kind;
+    bool icase;
+    bool exclude;
+};
+
+GlobSet compile(std::initializer_list<Pattern> patterns) {
+    GlobSet set;
+    for (const auto& p : patterns) set.add(p.text, p.kind, p.icase, p.exclude);
+    set.compile();
+    return set;
+}
+
+bool includes(const GlobSet& set, std::string_view name) {
+    return set.match(name.data(), name.size()).include;
+}
+
+bool excludes(const GlobSet& set, std::string_view name) {
+    return set.match(name.data(), name.size()).exclude;
+}
+
+bool glob(const char* pattern, std::string_view name, bool icase = false) {
+    return includes(compile({{pattern, GlobSet::Kind::Glob, icase, false}}), name);
+}
+
+void test_glob_set() {
+    CHECK(glob("*.c", "main.c"));
+    CHECK(glob("*.c", ".c"));
+    CHECK(!glob("*.c", "main.h"));
+    CHECK(!glob("*.c", "main.c.orig"));
+    CHECK(glob("a*b*c", "aXXbYYc"));
+    CHECK(!glob("a*b*c", "aXXcYYb"));
+
+    CHECK(glob("?.md", "a.md"));
+    CHECK(!glob("?.md", "ab.md"));
+    CHECK(!glob("?.md", ".md"));
+
+    CHECK(glob("[abc]x", "bx"));
+    CHECK(!glob("[abc]x", "dx"));
+    CHECK(glob("[a-c]x", "cx"));
+    CHECK(!glob("[a-c]x", "dx"));
+    CHECK(glob("[!abc]x", "dx"));
+    CHECK(!glob("[!abc]x", "ax"));
+    CHECK(glob("[^a]x", "bx"));
+    CHECK(!glob("[^a]x", "ax"));
+    CHECK(glob("[]]x", "]x"));
+
+    // A '-' before the closing ']' or first in the class is literal.
+    CHECK(glob("[a-]x", "-x"));
+    CHECK(glob("[a-]x", "ax"));
+    CHECK(!glob("[a-]x", "bx"));
+    CHECK(glob("[-a]x", "-x"));
+
+    CHECK(glob("\\*", "*"));
+    CHECK(!glob("\\*", "a"));
+    CHECK(glob("[ab", "[ab")); // unterminated class: a literal '['
+    CHECK(!glob("[ab", "a"));
+
+    CHECK(glob("*.C", "x.c", true));
+    CHECK(glob("[A-C]*", "banana", true));
+    CHECK(!glob("*.C", "x.c", false));
+
+    GlobSet text = compile({{"READ", GlobSet::Kind::Substring, true, false},
+                            {"Make", GlobSet::Kind::Substring, false, false}});
+    CHECK(includes(text, "readme.txt"));
+    CHECK(includes(text, "xREADy"));
+    CHECK(includes(text, "Makefile"));
+    CHECK(!includes(text, "makefile"));
+    CHECK(!includes(text, "other"));
+
+    GlobSet exact = compile({{"Notes.TXT", GlobSet::Kind::Exact, true, false}});
+    CHECK(includes(exact, "notes.txt"));
+    CHECK(!includes(exact, "notes.txt.bak"));
+
+    // -P and -I together: each name reports both verdicts.
+    GlobSet mixed = compile({{"*.c", GlobSet::Kind::Glob, false, false},
+                             {"test*", GlobSet::Kind::Glob, false, true},
+                             {"vendor", GlobSet::Kind::Glob, false, true}});
+    CHECK(includes(mixed, "main.c") && !excludes(mixed, "main.c"));
+    CHECK(includes(mixed, "test.c") && excludes(mixed, "test.c"));
+    CHECK(!includes(mixed, "test.h") && excludes(mixed, "test.h"));
+    CHECK(excludes(mixed, "vendor") && !excludes(mixed, "vendors"));
+
+    // Sets wider than 512 state bits take the heap scratch path.
+    std::string wide(600, 'a');
+    wide += '*';
+    GlobSet large = compile({{wide.c_str(), GlobSet::Kind::Glob, false, false},
+                             {"*.h", GlobSet::Kind::Glob, false, false}});
+    CHECK(includes(large, std::string(600, 'a') + "tail"));
+    CHECK(!includes(large, std::string(599, 'a')));
+    CHECK(includes(large, "x.h"));
+}
+
+// --- IgnoreRules -----------------------------------------------------------
+
+// The rules in effect for a directory `path` below the root, as layered by
+// the walker: `layer` belongs to the deepest directory holding a .gitignore.
+bool ignored(const IgnoreRules& layer, std::vector<std::string> path, std::string_view name,
+             bool is_dir = false) {
+    auto below = [&](int depth) {
+        std::string joined;
+        for (size_t i = static_cast<size_t>(depth); i < path.size(); ++i) {
+            if (!joined.empty()) joined += '/';
+            joined += path[i];
+        }
+        return joined;
+    };
+    return layer.ignored(static_cast<int>(path.size()), below, name, is_dir);
+}
+
+void test_ignore_rules() {
+    auto root = std::make_shared<IgnoreRules>(nullptr, 0);
+    root->parse("# comment\n"
+                "*.o\n"
+                "!keep.o\n"
+                "build/\n"
+                "/top.txt\n"
+                "docs/*.tmp\n"
+                "a/**/z.txt\n");
+
+    CHECK(ignored(*root, {}, "x.o"));
+    CHECK(ignored(*root, {"deep", "er"}, "x.o"));
+    CHECK(!ignored(*root, {}, "keep.o"));
+    CHECK(!ignored(*root, {}, "# comment"));
+
+    CHECK(ignored(*root, {}, "build", true));
+    CHECK(!ignored(*root, {}, "build", false));
+    CHECK(ignored(*root, {"sub"}, "build", true));
+
+    CHECK(ignored(*root, {}, "top.txt"));
+    CHECK(!ignored(*root, {"sub"}, "top.txt"));
+    CHECK(ignored(*root, {"docs"}, "a.tmp"));
+    CHECK(!ignored(*root, {"other"}, "a.tmp"));
+    CHECK(!ignored(*root, {"docs", "deep"}, "a.tmp"));
+    CHECK(ignored(*root, {"a"}, "z.txt"));
+    CHECK(ignored(*root, {"a", "b", "c"}, "z.txt"));
+    CHECK(!ignored(*root, {"b"}, "z.txt"));
+
+    // sub/.gitignore: overrides the root's rules below sub and anchors its
+    // own rules to sub.
+    auto sub = std::make_shared<IgnoreRules>(root, 1);
+    sub->parse("!*.o\r\nlocal\n/only_here\n");
+    CHECK(!ignored(*sub, {"sub"}, "x.o"));
+    CHECK(!ignored(*sub, {"sub", "sub2"}, "x.o"));
+    CHECK(ignored(*sub, {"sub"}, "local"));
+    CHECK(ignored(*sub, {"sub", "sub2"}, "local"));
+    CHECK(ignored(*sub, {"sub"}, "only_here"));
+    CHECK(!ignored(*sub, {"sub", "sub2"}, "only_here"));
+    CHECK(ignored(*sub, {"sub"}, "build", true));
+    CHECK(!ignored(*sub, {"sub"}, "top.txt"));
+}
+
+// --- write_json_string -----------------------------------------------------
+
+std::string json(std::string_view text) {
+    std::string captured;
+    OutputWriter out;
+    out.capture(&captured);
+    write_json_string(out, text);
+    out.capture(nullptr);
+    return captured;
+}
+
+void test_json_string() {
+    CHECK(json("plain") == "\"plain\"");
+    CHECK(json("") == "\"\"");
+    CHECK(json("a\"b\\c") == "\"a\\\"b\\\\c\"");
+    CHECK(json("\b\f\n\r\t") == "\"\\b\\f\\n\\r\\t\"");
+    CHECK(json("\x01\x1f") == "\"\\u0001\\u001f\"");
+    CHECK(json(std::string_view("a\0b", 3)) == "\"a\\u0000b\"");
+    CHECK(json("\x7f") == "\"\x7f\"");
+
+    // Well-formed UTF-8 goes out as is.
+    CHECK(json("caf\xc3\xa9") == "\"caf\xc3\xa9\"");
+    CHECK(json("\xe2\x82\xac") == "\"\xe2\x82\xac\"");
+    CHECK(json("\xf0\x9f\x8c\xb3") == "\"\xf0\x9f\x8c\xb3\"");
+
+    // Every byte of an ill-formed sequence becomes \udcXX.
+    CHECK(json("a\xff") == "\"a\\udcff\"");
+    CHECK(json("\xc0\xaf") == "\"\\udcc0\\udcaf\"");             // overlong
+    CHECK(json("\xe2\x82") == "\"\\udce2\\udc82\"");             // truncated
+    CHECK(json("\xed\xa0\x80") == "\"\\udced\\udca0\\udc80\"");  // surrogate
+    CHECK(json("\xf4\x90\x80\x80") == "\"\\udcf4\\udc90\\udc80\\udc80\""); // > U+10FFFF
+    CHECK(json("\x80x") == "\"\\udc80x\"");
+}
+
+// --- DupeFinder ------------------------------------------------------------
+
+struct TempDir {
+    std::string path;
+    TempDir() {
+        char templ[] = "/tmp/walker_test.XXXXXX";
+        if (mkdtemp(templ)) path = templ;
+    }
+    ~TempDir() {
+        std::error_code error;
+        if (!path.empty()) fs::remove_all(path, error);
+    }
+};
+
+void write_file(const std::string& path, const std::string& contents) {
+    std::ofstream(path, std::ios::binary) << contents;
+}
+
+void test_dupe_finder() {
+    TempDir dir;
+    CHECK(!dir.path.empty());
+    if (dir.path.empty()) return;
+
+    std::string base(20000, 'x');
+    for (size_t i = 0; i < base.size(); i += 7) base[i] = static_cast<char>('a' + i % 26);
+    std::string tail_differs = base;
+    tail_differs.back() ^= 1;
+    std::string middle_differs = base; // same samples, different contents
+    middle_differs[base.size() / 2] ^= 1;
+
+    std::vector<std::string> names = {"a", "b", "c", "tail", "middle", "unique", "empty"};
+    write_file(dir.path + "/a", base);
+    write_file(dir.path + "/b", base);
+    write_file(dir.path + "/c", base);
+    write_file(dir.path + "/tail", tail_differs);
+    write_file(dir.path + "/middle", middle_differs);
+    write_file(dir.path + "/unique", "only one of these");
+    write_file(dir.path + "/empty", "");
+    CHECK(link((dir.path + "/a").c_str(), (dir.path + "/hard").c_str()) == 0);
+    names.push_back("hard");
+
+    DupeFinder finder;
+    std::vector<struct stat> stats(names.size());
+    for (uint32_t i = 0; i < names.size(); ++i) {
+        CHECK(stat((dir.path + "/" + names[i]).c_str(), &stats[i]) == 0);
+        finder.add(i, static_cast<uint64_t>(stats[i].st_size), stats[i].st_dev, stats[i].st_ino);
+    }
+    finder.run(2, [&](uint32_t node) { return dir.path + "/" + names[node]; });
+
+    auto group = [&](size_t i) { return finder.group_of(stats[i].st_dev, stats[i].st_ino); };
+    CHECK(group(0) != 0);
+    CHECK(group(1) == group(0));
+    CHECK(group(2) == group(0));
+    CHECK(group(7) == group(0)); // hard link to a
+    CHECK(group(3) == 0);
+    CHECK(group(4) == 0);
+    CHECK(group(5) == 0);
+    CHECK(group(6) == 0);
+    CHECK(finder.groups() == 1);
+    CHECK(finder.files_in_groups() == 4);
+    CHECK(finder.reclaimable() == 2 * base.size()); // b and c; the hard link is free
+}
+
+} // namespace
+
+int main() {
+    test_glob_set();
+    test_ignore_rules();
+    test_json_string();
+    test_dupe_finder();
+    if (failures) std::fprintf(stderr, "%d check(s) failed\n", failures);
+    return failures ? 1 : 0;
+}
@@ -1,450 +1,7 @@
 // Experimental
-#include <algorithm>
-#include <filesystem>
-#include <iostream>
-#include <string>
-#include <vector>
-#include <cstring>
-#include <memory>
-#include <map>
-#include <regex>
-#ifdef _WIN32
-#include <windows.h>
-#endif
-namespace fs = std::filesystem;
+#include "tree_walker.h"
 
-struct Options {
-    bool show_all = false;
-    bool dirs_only = false;
-    bool no_color = false;
-    bool use_ascii = false;
-    bool show_size = false;
-    bool show_perms = false;
-    bool follow_symlinks = false;
-    bool only_symlinks = false;    // only show symlinks
-    bool only_executables = false; // only show executables
-    bool pattern_match = false;    // filter by pattern
-    bool exact_match = false;      // exact match for pattern (new flag)
-    std::string pattern = "";      // match
-    bool size_filter = false;      // filter by file size
-    uintmax_t min_size = 0;        // minimum file size
-    uintmax_t max_size = UINTMAX_MAX; // maximum file size
-    int max_depth = 999999;
-    std::string target_dir = ".";
-};
-
-class TreePrinter {
-private:
-    struct FileStats {
-        size_t directories = 0;
-        size_t files = 0;
-        size_t symlinks = 0;
-        size_t executables = 0;
-        uintmax_t total_size = 0;
-        size_t size_filtered_files = 0; // count of files within size range
-    };
-
-    const std::string COLOR_RESET = "\033[0m";
-    const std::string COLOR_DIR = "\033[1;34m";    // blue
-    const std::string COLOR_FILE = "\033[0;37m";   // white
-    const std::string COLOR_SYMLINK = "\033[1;36m"; // idk
-    const std::string COLOR_EXEC = "\033[1;32m";    // green
-
-    struct TreeChars {
-        std::string vertical;
-        std::string horizontal;
-        std::string corner;
-        std::string junction;
-    };
-
-    #ifdef _WIN32
-    TreeChars unicode_chars = {"│", "──", "└", "├"};
-    TreeChars ascii_chars = {"|", "--", "`", "+"};
-    #else
-    TreeChars unicode_chars = {"│", "──", "└", "├"};
-    TreeChars ascii_chars = {"|", "--", "`", "|"};
-    #endif
-
-    Options opts;
-    FileStats stats;
-    const TreeChars& chars;
-    std::vector<fs::path> matching_paths;
-    std::vector<fs::path> size_matching_paths;
-
-    void setup_console() {
-        #ifdef _WIN32
-        SetConsoleOutputCP(CP_UTF8);
-        
-        HANDLE hOut = GetStdHandle(STD_OUTPUT_HANDLE);
-        DWORD dwMode = 0;
-        GetConsoleMode(hOut, &dwMode);
-        dwMode |= ENABLE_VIRTUAL_TERMINAL_PROCESSING;
-        SetConsoleMode(hOut, dwMode);
-        #endif
-    }
-
-    std::string get_permissions(const fs::path& path) {
-        std::string result = "---------";
-        try {
-            auto perms = fs::status(path).permissions();
-            
-            if ((perms & fs::perms::owner_read) != fs::perms::none) result[0] = 'r';
-            if ((perms & fs::perms::owner_write) != fs::perms::none) result[1] = 'w';
-            if ((perms & fs::perms::owner_exec) != fs::perms::none) result[2] = 'x';
-            
-            if ((perms & fs::perms::group_read) != fs::perms::none) result[3] = 'r';
-            if ((perms & fs::perms::group_write) != fs::perms::none) result[4] = 'w';
-            if ((perms & fs::perms::group_exec) != fs::perms::none) result[5] = 'x';
-            
-            if ((perms & fs::perms::others_read) != fs::perms::none) result[6] = 'r';
-            if ((perms & fs::perms::others_write) != fs::perms::none) result[7] = 'w';
-            if ((perms & fs::perms::others_exec) != fs::perms::none) result[8] = 'x';
-            
-            return result;
-        } catch (const std::exception&) {
-            return result;
-        }
-    }
-
-    bool is_executable(const fs::path& path) {
-        try {
-            auto perms = fs::status(path).permissions();
-            return (perms & fs::perms::owner_exec) != fs::perms::none;
-        } catch (const std::exception&) {
-            return false;
-        }
-    }
-
-    std::string format_size(uintmax_t size) {
-        const char* units[] = {"B", "K", "M", "G", "T"};
-        int unit_index = 0;
-        double size_f = static_cast<double>(size);
-        
-        while (size_f >= 1024.0 && unit_index < 4) {
-            size_f /= 1024.0;
-            unit_index++;
-        }
-        
-        char buffer[32];
-        if (unit_index == 0) {
-            snprintf(buffer, sizeof(buffer), "%5ju%s", size, units[unit_index]);
-        } else {
-            snprintf(buffer, sizeof(buffer), "%5.1f%s", size_f, units[unit_index]);
-        }
-        return std::string(buffer);
-    }
-
-    bool is_size_in_range(const fs::path& path) {
-        if (!opts.size_filter) return true;
-        
-        try {
-            if (fs::is_directory(path)) return true;
-            
-            uintmax_t file_size = fs::file_size(path);
-            return (file_size >= opts.min_size && file_size <= opts.max_size);
-        } catch (const fs::filesystem_error&) {
-            return false;
-        }
-    }
-
-    bool matches_pattern(const fs::path& path) {
-        if (!opts.pattern_match) return true;
-        
-        std::string filename = path.filename().string();
-        if (opts.exact_match) {
-            return filename == opts.pattern;
-        }
-        
-        if (opts.pattern.find('*') != std::string::npos || opts.pattern.find('?') != std::string::npos) {
-            std::string regex_pattern = opts.pattern;
-            std::string::size_type pos = 0;
-            while ((pos = regex_pattern.find("*", pos)) != std::string::npos) {
-                regex_pattern.replace(pos, 1, ".*");
-                pos += 2;
-            }
-            pos = 0;
-            while ((pos = regex_pattern.find("?", pos)) != std::string::npos) {
-                regex_pattern.replace(pos, 1, ".");
-                pos += 1;
-            }
-            
-            std::regex pattern_regex(regex_pattern, std::regex_constants::icase);
-            return std::regex_match(filename, pattern_regex);
-        } else {
-            return filename.find(opts.pattern) != std::string::npos;
-        }
-    }
-
-    bool contains_size_matching_files(const fs::path& dir_path) {
-        try {
-            for (const auto& entry : fs::recursive_directory_iterator(dir_path)) {
-                if (!fs::is_directory(entry.path()) && is_size_in_range(entry.path())) {
-                    size_matching_paths.push_back(entry.path());
-                    return true;
-                }
-            }
-        } catch (const fs::filesystem_error&) {
-        }
-        return false;
-    }
-
-    bool is_on_path_to_size_match(const fs::path& path) {
-        if (!opts.size_filter) return true;
-        
-        for (const auto& matching_path : size_matching_paths) {
-            if (matching_path.string().find(path.string()) == 0) {
-                return true;
-            }
-        }
-        return false;
-    }
-
-    bool contains_matching_files(const fs::path& dir_path) {
-        try {
-            for (const auto& entry : fs::recursive_directory_iterator(dir_path)) {
-                if (matches_pattern(entry.path())) {
-                    matching_paths.push_back(entry.path());
-                    return true;
-                }
-            }
-        } catch (const fs::filesystem_error&) {
-        
-        }
-        return false;
-    }
-
-
-    bool is_on_path_to_match(const fs::path& path) {
-        if (!opts.pattern_match) return true;
-        
-        for (const auto& matching_path : matching_paths) {
-            if (matching_path.string().find(path.string()) == 0) {
-                return true;
-            }
-        }
-        return false;
-    }
-
-    void print_entry(const fs::path& path, const std::string& prefix, bool is_last) {
-        std::string name = path.filename().string();
-        if (name.empty()) return;
-
-        bool is_symlink = false;
-        bool is_dir = false;
-        bool is_exec = false;
-        
-        try {
-            is_symlink = fs::is_symlink(path);
-            is_dir = fs::is_directory(path);
-            is_exec = is_executable(path);
-            
-            if (opts.only_symlinks && !is_symlink) return;
-            if (opts.only_executables && !is_exec && !is_dir) return;
-            if (opts.pattern_match && !is_dir && !matches_pattern(path)) return;
-            if (opts.pattern_match && is_dir && !is_on_path_to_match(path)) return;
-            
-            if (opts.size_filter && !is_dir && !is_size_in_range(path)) return;
-            if (opts.size_filter && is_dir && !is_on_path_to_size_match(path)) return;
-            
-        } catch (const fs::filesystem_error&) {
-            if (opts.only_symlinks || opts.only_executables || 
-                opts.pattern_match || opts.size_filter) return;
-        }
-
-        std::string connector = is_last ? chars.corner + chars.horizontal 
-                                      : chars.junction + chars.horizontal;
-
-        std::string display_name = name;
-        std::string color = COLOR_FILE;
-        std::string suffix;
-
-        try {
-            if (is_symlink) {
-                color = COLOR_SYMLINK;
-                fs::path target = fs::read_symlink(path);
-                suffix = " -> " + target.string();
-                stats.symlinks++;
-            }
-            else if (is_dir) {
-                color = COLOR_DIR;
-                stats.directories++;
-            }
-            else {
-                stats.files++;
-                
-                if (opts.size_filter && is_size_in_range(path)) {
-                    stats.size_filtered_files++;
-                }
-                
-                if (is_exec) {
-                    color = COLOR_EXEC;
-                    stats.executables++;
-                }
-            }
-
-            if (opts.show_perms) {
-                display_name = get_permissions(path) + " " + display_name;
-            }
-
-            if ((opts.show_size || opts.size_filter) && !is_dir) {
-                uintmax_t size = fs::file_size(path);
-                stats.total_size += size;
-                display_name = format_size(size) + " " + display_name;
-            }
-
-        } catch (const fs::filesystem_error&) {
-            display_name = "[error accessing " + name + "]";
-            color = "\033[1;31m"; // red
-        }
-
-        if (opts.no_color) {
-            std::cout << prefix << connector << " " << display_name << suffix << std::endl;
-        } else {
-            std::cout << prefix << connector << " " << color << display_name 
-                     << COLOR_RESET << suffix << std::endl;
-        }
-    }
-
-void print_tree(const fs::path& dir_path, const std::string& prefix, int depth) {
-    if (depth > opts.max_depth) return;
-
-    std::vector<fs::path> entries;
-    std::vector<fs::path> visible_entries; // Add this to track which entries will be shown
-    
-    try {
-        for (const auto& entry : fs::directory_iterator(dir_path)) {
-            if (!opts.show_all && entry.path().filename().string()[0] == '.') {
-                continue;
-            }
-            
-            entries.push_back(entry.path());
-            
-            bool is_dir = fs::is_directory(entry.path());
-            bool show_entry = true;
-            
-            if (opts.dirs_only && !is_dir) {
-                show_entry = false;
-            }
-            
-            if (show_entry && opts.only_symlinks && !fs::is_symlink(entry.path())) {
-                if (!is_dir) show_entry = false;
-            }
-            
-            if (show_entry && opts.only_executables && !is_executable(entry.path())) {
-                if (!is_dir) show_entry = false;
-            }
-            
-            if (show_entry && opts.pattern_match) {
-                if (is_dir) {
-                    show_entry = is_on_path_to_match(entry.path());
-                } else {
-                    show_entry = matches_pattern(entry.path());
-                }
-            }
-            
-            if (show_entry && opts.size_filter) {
-                if (is_dir) {
-                    show_entry = is_on_path_to_size_match(entry.path());
-                } else {
-                    show_entry = is_size_in_range(entry.path());
-                }
-            }
-            
-            if (show_entry) {
-                visible_entries.push_back(entry.path());
-            }
-        }
-    } catch (const fs::filesystem_error&) {
-        std::cerr << "Error: Permission denied or other error accessing " 
-                 << dir_path << std::endl;
-        return;
-    }
-
-    std::sort(entries.begin(), entries.end());
-    std::sort(visible_entries.begin(), visible_entries.end());
-
-    for (size_t i = 0; i < entries.size(); ++i) {
-        bool is_dir = fs::is_directory(entries[i]);
-        
-        auto it = std::find(visible_entries.begin(), visible_entries.end(), entries[i]);
-        bool is_visible = (it != visible_entries.end());
-        
-        if (is_visible) {
-            size_t visible_index = std::distance(visible_entries.begin(), it);
-            bool is_last = (visible_index == visible_entries.size() - 1);
-            
-            print_entry(entries[i], prefix, is_last);
-            
-            if (is_dir) {
-                std::string new_prefix = prefix + (is_last ? "    " : chars.vertical + "   ");
-                print_tree(entries[i], new_prefix, depth + 1);
-            }
-        }
-    }
-}
-
-public:
-    TreePrinter(const Options& options) 
-        : opts(options), 
-          chars(options.use_ascii ? ascii_chars : unicode_chars) {
-        setup_console();
-        
-        if (opts.pattern_match) {
-            try {
-                contains_matching_files(fs::path(opts.target_dir));
-            } catch (const fs::filesystem_error& e) {
-                std::cerr << "Error during pattern pre-scan: " << e.what() << std::endl;
-            }
-        }
-        
-        if (opts.size_filter) {
-            try {
-                contains_size_matching_files(fs::path(opts.target_dir));
-            } catch (const fs::filesystem_error& e) {
-                std::cerr << "Error during size filter pre-scan: " << e.what() << std::endl;
-            }
-        }
-    }
-
-    void print() {
-        fs::path root_path = fs::path(opts.target_dir);
-        
-        try {
-            if (fs::is_symlink(root_path)) {
-                std::cout << opts.target_dir << " -> " 
-                         << fs::read_symlink(root_path).string() << std::endl;
-            } else {
-                std::cout << opts.target_dir << std::endl;
-            }
-
-            print_tree(root_path, "", 1);
-
-            std::cout << "\n" << stats.directories << " directories";
-            if (!opts.dirs_only) {
-                std::cout << ", " << stats.files << " files";
-            }
-            if (stats.symlinks > 0) {
-                std::cout << ", " << stats.symlinks << " symlinks";
-            }
-            if (stats.executables > 0) {
-                std::cout << ", " << stats.executables << " executables";
-            }
-            if (opts.size_filter) {
-                std::cout << ", " << stats.size_filtered_files << " size-filtered files";
-                std::cout << " (" << format_size(opts.min_size) << " - " 
-                         << format_size(opts.max_size) << ")";
-            }
-            if (opts.show_size || opts.size_filter) {
-                std::cout << "\nTotal size: " << format_size(stats.total_size);
-            }
-            std::cout << std::endl;
-
-        } catch (const fs::filesystem_error& e) {
-            std::cerr << "Error: " << e.what() << std::endl;
-            exit(1);
-        }
-    }
-};
+using namespace tree_walker;
 
 uintmax_t parse_size(const std::string& size_str) {
     if (size_str.empty()) return 0;
@@ -499,6 +56,18 @@ bool parse_size_range(const std::string& range_str, uintmax_t& min_size, uintmax
     return true;
 }
 
+// Parses all of `text` as a decimal number from `min` to `max`.
+bool parse_number(const char* text, long long min, long long max, long long& value) {
+    errno = 0;
+    char* end = nullptr;
+    long long parsed = std::strtoll(text, &end, 10);
+    if (end == text || *end != '\0' || errno == ERANGE || parsed < min || parsed > max) {
+        return false;
+    }
+    value = parsed;
+    return true;
+}
+
 void print_usage() {
     std::cerr << "Usage: tree [OPTIONS] [DIR]\n"
               << "Options:\n"
@@ -508,12 +77,43 @@ void print_usage() {
               << "  -i                     Use ASCII characters\n"
               << "  -s                     Show file sizes\n"
               << "  -p                     Show permissions\n"
-              << "  -L                     Follow symbolic links\n"
+              << "  -L                     Follow symbolic links to directories\n"
+              << "  -x                     Stay on the filesystem of the root directory\n"
               << "  -l                     Show only symbolic links\n"
               << "  -e                     Show only executable files\n"
-              << "  -P <name> [--exact]    Show only files with that name\n"
+              << "  -P <name> [--exact]    Show only files with that name (repeatable)\n"
+              << "  -I <pattern>           Do not list entries matching pattern (repeatable)\n"
+              << "  --gitignore            Hide what .gitignore files below the root ignore\n"
+              << "  --ignore-case          Match -P/-I patterns case-insensitively\n"
+              << "  --match-case           Match wildcard -P patterns case-sensitively\n"
               << "  -S range               Show only files within size range (e.g., 36K:1M)\n"  
-              << "  -D n                   Max display depth\n";
+              << "  -D n                   Max display depth\n"
+              << "  -U                     Do not sort; stream entries in directory order\n"
+              << "  -t                     Sort by modification time, newest first\n"
+              << "  --sort=<order>         Sort by name, mtime (newest first) or size\n"
+              << "                         (largest first)\n"
+              << "  --dirsfirst            List directories before other entries\n"
+              << "  --top n                Show only the first n entries of each directory\n"
+              << "  -j n                   Read directories with n threads (1 to 1024)\n"
+              << "  --fd-budget n          Keep at most n directory descriptors open (256)\n"
+              << "  --uring                Fetch metadata in batches through io_uring (Linux)\n"
+              << "  --du                   Show apparent and allocated size of every subtree\n"
+              << "  --du-top n             List only the n heaviest directories\n"
+              << "  --save <file>          Also write the scanned tree to a snapshot file\n"
+              << "  --fromfile <file>      Render a snapshot instead of the filesystem\n"
+              << "  --watch                Keep running and redraw as the tree changes\n"
+              << "  -J                     Print the tree as one nested JSON document\n"
+              << "  --ndjson               Print one JSON object per entry, with its path\n"
+              << "  --count                Print only the summary line, skipping the stat\n"
+              << "                         calls it can\n"
+              << "  --dupes                Mark files with identical contents and show the\n"
+              << "                         space their extra copies take\n"
+              << "  --cache <dir>          Keep directory listings in <dir> and reuse the\n"
+              << "                         ones whose mtime and ctime have not changed;\n"
+              << "                         a file changed in place keeps its cached size\n"
+              << "                         and mode until its directory changes\n"
+              << "  -v                     Print syscall statistics to stderr\n"
+              << "  --profile              Print phase timings and counters as JSON to stderr\n";
 }
 
 
@@ -527,6 +127,108 @@ int main(int argc, char* argv[]) {
             opts.exact_match = true;
             continue;
         }
+        if (arg == "--save" || arg == "--fromfile") {
+            if (++i >= argc) {
+                std::cerr << "Error: " << arg << " requires a file\n";
+                return 1;
+            }
+            (arg == "--save" ? opts.save_file : opts.from_file) = argv[i];
+            continue;
+        }
+        if (arg == "--cache") {
+            if (++i >= argc) {
+                std::cerr << "Error: --cache requires a directory\n";
+                return 1;
+            }
+            opts.cache_dir = argv[i];
+            continue;
+        }
+        if (arg == "--uring") {
+            opts.uring = true;
+            continue;
+        }
+        if (arg == "--profile") {
+            opts.profile = true;
+            continue;
+        }
+        if (arg == "--watch") {
+            opts.watch = true;
+            continue;
+        }
+        if (arg == "--gitignore") {
+            opts.gitignore = true;
+            continue;
+        }
+        if (arg == "--ndjson") {
+            opts.format = OutputFormat::Ndjson;
+            continue;
+        }
+        if (arg == "--count") {
+            opts.count_only = true;
+            continue;
+        }
+        if (arg == "--dupes") {
+            opts.dupes = true;
+            continue;
+        }
+        if (arg == "--du") {
+            opts.du = true;
+            continue;
+        }
+        if (arg == "--du-top") {
+            long long count;
+            if (++i >= argc || !parse_number(argv[i], 1, LLONG_MAX, count)) {
+                std::cerr << "Error: --du-top requires a number\n";
+                return 1;
+            }
+            opts.du = true;
+            opts.du_top = static_cast<size_t>(count);
+            continue;
+        }
+        if (arg.compare(0, 7, "--sort=") == 0) {
+            std::string order = arg.substr(7);
+            if (order == "name") {
+                opts.sort = SortOrder::Name;
+            } else if (order == "mtime") {
+                opts.sort = SortOrder::Mtime;
+            } else if (order == "size") {
+                opts.sort = SortOrder::Size;
+            } else {
+                std::cerr << "Error: --sort must be name, mtime or size\n";
+                return 1;
+            }
+            continue;
+        }
+        if (arg == "--dirsfirst") {
+            opts.dirs_first = true;
+            continue;
+        }
+        if (arg == "--top") {
+            long long count;
+            if (++i >= argc || !parse_number(argv[i], 1, LLONG_MAX, count)) {
+                std::cerr << "Error: --top requires a number\n";
+                return 1;
+            }
+            opts.top = static_cast<size_t>(count);
+            continue;
+        }
+        if (arg == "--fd-budget") {
+            long long budget;
+            if (++i >= argc || !parse_number(argv[i], 1, LLONG_MAX, budget)) {
+                std::cerr << "Error: --fd-budget requires a number\n";
+                return 1;
+            }
+            opts.fd_budget = std::max<size_t>(static_cast<size_t>(budget), 2);
+            continue;
+        }
+        if (arg == "--ignore-case") {
+            opts.ignore_case = true;
+            continue;
+        }
+        if (arg == "--match-case") {
+            opts.match_case = true;
+            continue;
+        }
         
         if (arg[0] == '-' && arg.length() > 1 && arg[1] != '-') {
             for (size_t j = 1; j < arg.length(); ++j) {
@@ -538,12 +240,17 @@ int main(int argc, char* argv[]) {
                     case 's': opts.show_size = true; break;
                     case 'p': opts.show_perms = true; break;
                     case 'L': opts.follow_symlinks = true; break;
+                    case 'x': opts.one_filesystem = true; break;
                     case 'l': opts.only_symlinks = true; break;
                     case 'e': opts.only_executables = true; break;
+                    case 'v': opts.verbose = true; break;
+                    case 'U': opts.unsorted = true; break;
+                    case 't': opts.sort = SortOrder::Mtime; break;
+                    case 'J': opts.format = OutputFormat::Json; break;
                     case 'P':
                         if (++i < argc) {
                             opts.pattern_match = true;
-                            opts.pattern = argv[i];
+                            opts.patterns.push_back(argv[i]);
                         } else {
                             std::cerr << "Error: -P requires a pattern\n";
                             return 1;
@@ -561,18 +268,36 @@ int main(int argc, char* argv[]) {
                             return 1;
                         }
                         break;
-                    case 'D':
+                    case 'D': {
+                        long long depth;
+                        if (++i >= argc || !parse_number(argv[i], 1, INT_MAX, depth)) {
+                            std::cerr << "Error: -D requires a number\n";
+                            return 1;
+                        }
+                        opts.max_depth = static_cast<int>(depth);
+                        break;
+                    }
+                    case 'j': {
+                        long long threads;
+                        if (++i >= argc || !parse_number(argv[i], 1, 1024, threads)) {
+                            std::cerr << "Error: -j requires a number\n";
+                            return 1;
+                        }
+                        opts.threads = static_cast<int>(threads);
+                        break;
+                    }
+                    case 'I':
                         if (++i < argc) {
-                            opts.max_depth = std::stoi(argv[i]);
+                            opts.exclude_patterns.push_back(argv[i]);
                         } else {
-                            std::cerr << "Error: -D requires a number\n";
+                            std::cerr << "Error: -I requires a pattern\n";
                             return 1;
                         }
                         break;
                     case 'f':  // same as -P
                         if (++i < argc) {
                             opts.pattern_match = true;
-                            opts.pattern = argv[i];
+                            opts.patterns.push_back(argv[i]);
                         } else {
                             std::cerr << "Error: -f requires a pattern\n";
                             return 1;
@@ -588,6 +313,43 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    if (opts.watch && (opts.pattern_match || opts.size_filter || opts.du ||
+                       !opts.save_file.empty() || !opts.from_file.empty() ||
+                       !opts.cache_dir.empty())) {
+        std::cerr << "Error: --watch cannot be combined with -P, -S, --du, --save, "
+                     "--fromfile or --cache\n";
+        return 1;
+    }
+
+    if (opts.count_only && (opts.watch || opts.du_top || !opts.save_file.empty())) {
+        std::cerr << "Error: --count cannot be combined with --watch, --du-top or --save\n";
+        return 1;
+    }
+
+    if (opts.format != OutputFormat::Tree && (opts.watch || opts.du_top || opts.count_only)) {
+        std::cerr << "Error: -J and --ndjson cannot be combined with --watch, --du-top or --count\n";
+        return 1;
+    }
+
+    // Contents are read from the filesystem, so a snapshot has nothing to compare.
+    if (opts.dupes && (opts.watch || opts.du_top || opts.count_only ||
+                       !opts.save_file.empty() || !opts.from_file.empty())) {
+        std::cerr << "Error: --dupes cannot be combined with --watch, --du-top, --count, "
+                     "--save or --fromfile\n";
+        return 1;
+    }
+
+    if (opts.unsorted && (opts.sort != SortOrder::Name || opts.dirs_first || opts.top)) {
+        std::cerr << "Error: -U cannot be combined with -t, --sort, --dirsfirst or --top\n";
+        return 1;
+    }
+
+    // Snapshots keep names and metadata only, not the .gitignore contents.
+    if (opts.gitignore && (!opts.save_file.empty() || !opts.from_file.empty())) {
+        std::cerr << "Error: --gitignore cannot be combined with --save or --fromfile\n";
+        return 1;
+    }
+
     TreePrinter printer(opts);
     printer.print();
     return 0;
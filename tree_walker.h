@@ -0,0 +1,5275 @@
+// Directory walker behind tree(1), usable on its own. Configure an Options,
+// implement EntryVisitor and call TreePrinter::visit_tree(): every visible
+// entry arrives as an EntryRecord, in display order and with all filters
+// applied, without any text being formatted. Everything is declared in
+// namespace tree_walker.
+//
+//     struct Sizes : tree_walker::EntryVisitor {
+//         uint64_t total = 0;
+//         void visit(const tree_walker::EntryRecord& entry) override { total += entry.size; }
+//     };
+//     tree_walker::Options opts;
+//     opts.target_dir = "/data";
+//     opts.show_size = true;
+//     Sizes sizes;
+//     tree_walker::TreePrinter(opts).visit_tree(sizes);
+#ifndef TREE_WALKER_H
+#define TREE_WALKER_H
+
+#include <algorithm>
+#include <bitset>
+#include <cctype>
+#include <charconv>
+#include <cerrno>
+#include <climits>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstring>
+#include <ctime>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <map>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <thread>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sched.h>
+#define TREE_HAVE_URING 1
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+namespace tree_walker {
+
+namespace fs = std::filesystem;
+
+// Entry order within a directory. Ties, and everything under Name, fall
+// back to the name.
+enum class SortOrder {
+    Name,
+    Mtime,  // -t: newest first
+    Size,   // --sort=size: largest first
+};
+
+// What the walk is written as.
+enum class OutputFormat {
+    Tree,
+    Json,    // -J: one nested document
+    Ndjson,  // --ndjson: one object per line, with the full path
+};
+
+struct Options {
+    bool show_all = false;
+    bool dirs_only = false;
+    bool no_color = false;
+    bool use_ascii = false;
+    bool show_size = false;
+    bool show_perms = false;
+    bool follow_symlinks = false;
+    bool one_filesystem = false;   // -x: stay on the root's filesystem
+    bool only_symlinks = false;    // only show symlinks
+    bool only_executables = false; // only show executables
+    bool pattern_match = false;    // filter by pattern
+    bool exact_match = false;      // exact match for pattern (new flag)
+    bool ignore_case = false;      // --ignore-case for every pattern
+    bool match_case = false;       // --match-case for every pattern
+    std::vector<std::string> patterns;         // -P / -f, any may match
+    std::vector<std::string> exclude_patterns; // -I
+    bool size_filter = false;      // filter by file size
+    uintmax_t min_size = 0;        // minimum file size
+    uintmax_t max_size = UINTMAX_MAX; // maximum file size
+    int max_depth = 999999;
+    int threads = 1;               // directory reader threads (-j)
+    bool unsorted = false;         // -U: keep readdir order
+    SortOrder sort = SortOrder::Name;
+    bool dirs_first = false;       // --dirsfirst: directories before other entries
+    size_t top = 0;                // --top: keep the first N entries of each directory
+    size_t fd_budget = 256;        // --fd-budget: directory descriptors held open at once
+    bool verbose = false;          // print syscall statistics to stderr
+    bool profile = false;          // --profile: phase timings as JSON on stderr
+    std::string target_dir = ".";
+    bool du = false;               // --du: subtree sizes on directories
+    size_t du_top = 0;             // --du-top: list only the N heaviest
+    std::string save_file;         // --save: write a snapshot of the scan
+    std::string from_file;         // --fromfile: render a saved snapshot
+    std::string cache_dir;         // --cache: reuse unchanged directory listings
+    bool uring = false;            // --uring: batch stat calls through io_uring
+    bool watch = false;            // --watch: redraw as the tree changes
+    bool gitignore = false;        // --gitignore: hide what .gitignore files ignore
+    bool count_only = false;       // --count: print the summary line only
+    bool dupes = false;            // --dupes: mark files with identical contents
+    OutputFormat format = OutputFormat::Tree;
+};
+
+// Phases of a run that --profile times separately.
+enum class Phase : uint8_t {
+    Read,      // opendir, readdir and snapshot/cache lookups
+    Metadata,  // stat and readlink
+    Filter,    // name and pattern checks
+    Sort,
+    Prune,     // post-order resolution for -P/-S and --du
+    Format,    // building output lines
+    Write,     // write(2) on stdout
+    Hash,      // --dupes: reading and comparing file contents
+    None,      // no phase; also the number of phases
+};
+
+constexpr size_t PHASE_COUNT = static_cast<size_t>(Phase::None);
+
+const char* const PHASE_NAMES[PHASE_COUNT] = {
+    "read", "metadata", "filter", "sort", "prune", "format", "write", "hash",
+};
+
+// --profile: time spent in each phase, taken from a monotonic clock and
+// owned by one thread. Phases nest; entering one pauses the enclosing one,
+// so time is charged to exactly one phase. A disabled clock is never read,
+// leaving one predictable branch per phase boundary.
+class PhaseClock {
+public:
+    bool enabled = false;
+    uint64_t ns[PHASE_COUNT] = {};
+
+    Phase enter(Phase phase) {
+        uint64_t now = now_ns();
+        if (current != Phase::None) ns[static_cast<size_t>(current)] += now - mark;
+        mark = now;
+        Phase previous = current;
+        current = phase;
+        return previous;
+    }
+
+    void leave(Phase previous) {
+        uint64_t now = now_ns();
+        ns[static_cast<size_t>(current)] += now - mark;
+        mark = now;
+        current = previous;
+    }
+
+    void merge(const PhaseClock& other) {
+        for (size_t i = 0; i < PHASE_COUNT; ++i) ns[i] += other.ns[i];
+    }
+
+    static uint64_t now_ns() {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+private:
+    Phase current = Phase::None;
+    uint64_t mark = 0;
+};
+
+class ScopedPhase {
+public:
+    ScopedPhase(PhaseClock* clock, Phase phase)
+        : clock(clock && clock->enabled ? clock : nullptr) {
+        if (this->clock) previous = this->clock->enter(phase);
+    }
+    ScopedPhase(PhaseClock& clock, Phase phase) : ScopedPhase(&clock, phase) {}
+    ~ScopedPhase() {
+        if (clock) clock->leave(previous);
+    }
+
+    ScopedPhase(const ScopedPhase&) = delete;
+    ScopedPhase& operator=(const ScopedPhase&) = delete;
+
+private:
+    PhaseClock* clock;
+    Phase previous = Phase::None;
+};
+
+// Buffered writer for stdout. Lines are appended to one reusable buffer that
+// goes out in large blocks; when stdout is a terminal every line is flushed
+// as it completes so output still appears interactively. Appending never
+// allocates once the buffer exists.
+class OutputWriter {
+public:
+    explicit OutputWriter(int fd = STDOUT_FILENO, size_t capacity = 1 << 16)
+        : fd(fd), buffer(new char[capacity]), capacity(capacity),
+          line_buffered(isatty(fd)) {}
+
+    ~OutputWriter() { flush(); }
+
+    OutputWriter(const OutputWriter&) = delete;
+    OutputWriter& operator=(const OutputWriter&) = delete;
+
+    void write(const char* data, size_t len) {
+        if (sink) {
+            sink->append(data, len);
+            return;
+        }
+        if (len <= capacity - used) {
+            std::memcpy(buffer.get() + used, data, len);
+            used += len;
+            return;
+        }
+        if (len < capacity / 2) {
+            flush();
+            std::memcpy(buffer.get(), data, len);
+            used = len;
+            return;
+        }
+        // Too big to be worth copying: send what is buffered and the new
+        // data together.
+        struct iovec iov[2] = {{buffer.get(), used}, {const_cast<char*>(data), len}};
+        write_all(iov, 2);
+        used = 0;
+    }
+
+    void write(const std::string& text) { write(text.data(), text.size()); }
+    void write(const char* text) { write(text, std::strlen(text)); }
+    void write(std::string_view text) { write(text.data(), text.size()); }
+
+    void write_number(uintmax_t value) {
+        char digits[24];
+        char* end = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+        write(digits, static_cast<size_t>(end - digits));
+    }
+
+    void end_line() {
+        write("\n", 1);
+        if (line_buffered) flush();
+    }
+
+    void flush() {
+        if (used == 0) return;
+        struct iovec iov = {buffer.get(), used};
+        write_all(&iov, 1);
+        used = 0;
+    }
+
+    uintmax_t bytes_written() const { return written; }
+
+    // Appends everything written to `text` instead of the descriptor until
+    // called again with nullptr. --watch renders its frame this way.
+    void capture(std::string* text) {
+        flush();
+        sink = text;
+    }
+
+    // Charges time spent in write(2) to Phase::Write on `phases`.
+    void profile(PhaseClock* phases) { clock = phases; }
+
+private:
+    int fd;
+    PhaseClock* clock = nullptr;
+    std::string* sink = nullptr;
+    std::unique_ptr<char[]> buffer;
+    size_t capacity;
+    size_t used = 0;
+    bool line_buffered;
+    bool failed = false;
+    uintmax_t written = 0;
+
+    void write_all(struct iovec* iov, int count) {
+        ScopedPhase phase(clock, Phase::Write);
+        while (count > 0 && !failed) {
+            ssize_t n = writev(fd, iov, count);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                failed = true;
+                return;
+            }
+            written += static_cast<uintmax_t>(n);
+            size_t left = static_cast<size_t>(n);
+            while (count > 0 && left >= iov->iov_len) {
+                left -= iov->iov_len;
+                iov++;
+                count--;
+            }
+            if (count > 0) {
+                iov->iov_base = static_cast<char*>(iov->iov_base) + left;
+                iov->iov_len -= left;
+            }
+        }
+    }
+};
+
+// Length of the well-formed UTF-8 sequence at `p`, or 0 if it is not one
+// (overlong forms, surrogates and code points past U+10FFFF included).
+inline size_t utf8_sequence_length(const unsigned char* p, size_t left) {
+    unsigned char c = p[0];
+    size_t len;
+    unsigned char low = 0x80, high = 0xBF; // bounds of the second byte
+    if (c >= 0xC2 && c <= 0xDF) {
+        len = 2;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        len = 3;
+        if (c == 0xE0) low = 0xA0;
+        if (c == 0xED) high = 0x9F;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        len = 4;
+        if (c == 0xF0) low = 0x90;
+        if (c == 0xF4) high = 0x8F;
+    } else {
+        return 0;
+    }
+    if (left < len || p[1] < low || p[1] > high) return 0;
+    for (size_t i = 2; i < len; ++i) {
+        if ((p[i] & 0xC0) != 0x80) return 0;
+    }
+    return len;
+}
+
+// Writes `text` as a JSON string, quotes included, without allocating.
+// Runs of bytes that need no escape go out in one write. Names are bytes,
+// not text: a byte that is not part of valid UTF-8 is written as \udcXX, the
+// lone surrogate Python's surrogateescape decodes back to that byte.
+inline void write_json_string(OutputWriter& out, std::string_view text) {
+    static const char HEX[] = "0123456789abcdef";
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(text.data());
+    size_t len = text.size();
+    size_t run = 0; // start of the bytes not written yet
+    out.write("\"", 1);
+    for (size_t i = 0; i < len;) {
+        unsigned char c = p[i];
+        if (c >= 0x20 && c < 0x80 && c != '"' && c != '\\') {
+            i++;
+            continue;
+        }
+        if (c >= 0x80) {
+            size_t seq = utf8_sequence_length(p + i, len - i);
+            if (seq) {
+                i += seq;
+                continue;
+            }
+        }
+
+        out.write(text.data() + run, i - run);
+        char escape[6] = {'\\', 'u', '0', '0', HEX[c >> 4], HEX[c & 15]};
+        size_t escape_len = 2;
+        switch (c) {
+            case '"': escape[1] = '"'; break;
+            case '\\': escape[1] = '\\'; break;
+            case '\b': escape[1] = 'b'; break;
+            case '\f': escape[1] = 'f'; break;
+            case '\n': escape[1] = 'n'; break;
+            case '\r': escape[1] = 'r'; break;
+            case '\t': escape[1] = 't'; break;
+            default:
+                if (c >= 0x80) {
+                    escape[2] = 'd';
+                    escape[3] = 'c';
+                }
+                escape_len = 6;
+        }
+        out.write(escape, escape_len);
+        run = ++i;
+    }
+    out.write(text.data() + run, len - run);
+    out.write("\"", 1);
+}
+
+// Matches file names against every -P and -I pattern at once. Patterns are
+// compiled at startup into a single bit-parallel automaton (one state bit per
+// pattern token, Shift-And style), so a name is matched in one pass over its
+// bytes however many patterns there are. Supports *, ?, [...] classes with
+// ranges and ! or ^ negation, and backslash escapes.
+class GlobSet {
+public:
+    enum class Kind {
+        Glob,      // anchored wildcard pattern
+        Substring, // plain text found anywhere in the name
+        Exact      // the whole name, no wildcards
+    };
+
+    struct Match {
+        bool include = false; // matched some -P pattern
+        bool exclude = false; // matched some -I pattern
+    };
+
+    void add(const std::string& pattern, Kind kind, bool icase, bool exclude) {
+        // A glob without any wildcard or escape is just a name.
+        if (kind == Kind::Glob && pattern.find_first_of("*?[\\") == std::string::npos) {
+            kind = Kind::Exact;
+        }
+
+        Parsed parsed;
+        parsed.exclude = exclude;
+        parsed.literal = pattern;
+        parsed.kind = kind;
+        parsed.icase = icase;
+        if (icase) {
+            for (char& c : parsed.literal) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        }
+
+        if (kind == Kind::Substring) parsed.tokens.push_back(star_token());
+        if (kind == Kind::Glob) {
+            parse_glob(pattern, icase, parsed.tokens);
+        } else {
+            for (unsigned char c : pattern) parsed.tokens.push_back(char_token(c, icase));
+        }
+        if (kind == Kind::Substring) parsed.tokens.push_back(star_token());
+
+        // Consecutive stars are one star; this keeps the epsilon closure in
+        // match() to a single shift.
+        std::vector<Token> collapsed;
+        for (auto& token : parsed.tokens) {
+            if (token.star && !collapsed.empty() && collapsed.back().star) continue;
+            collapsed.push_back(token);
+        }
+        parsed.tokens.swap(collapsed);
+        patterns.push_back(std::move(parsed));
+    }
+
+    bool empty() const { return patterns.empty(); }
+
+    void compile() {
+        size_t bits = 0;
+        for (const auto& p : patterns) bits += p.tokens.size() + 1;
+        words = (bits + 63) / 64;
+        if (words == 0) return;
+
+        char_masks.assign(256 * words, 0);
+        start.assign(words, 0);
+        stars.assign(words, 0);
+        include_accept.assign(words, 0);
+        exclude_accept.assign(words, 0);
+
+        // Each pattern owns a start bit followed by one bit per token. Start
+        // bits are in no character mask, so nothing shifts across patterns.
+        size_t bit = 0;
+        for (const auto& p : patterns) {
+            set_bit(start, bit++);
+            for (const auto& token : p.tokens) {
+                if (token.star) set_bit(stars, bit);
+                for (int c = 0; c < 256; ++c) {
+                    if (token.star || token.chars[c]) {
+                        char_masks[c * words + bit / 64] |= 1ULL << (bit % 64);
+                    }
+                }
+                bit++;
+            }
+            set_bit(p.exclude ? exclude_accept : include_accept, bit - 1);
+        }
+
+        initial = start;
+        close_over_stars(initial.data());
+
+        // Sets made only of substrings and exact names (the usual -P <text>,
+        // plain -I names, with or without --ignore-case) skip the automaton
+        // for memmem/memcmp against the name, lowercased once if needed.
+        literal_fast_path = true;
+        fold_name = false;
+        for (const auto& p : patterns) {
+            if (p.kind == Kind::Glob) literal_fast_path = false;
+            if (p.icase) fold_name = true;
+        }
+    }
+
+    Match match(const char* name, size_t len) const {
+        Match result;
+        if (patterns.empty()) return result;
+
+        if (literal_fast_path) {
+            thread_local std::string folded;
+            if (fold_name) {
+                folded.assign(name, len);
+                for (char& c : folded) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+            }
+            for (const auto& p : patterns) {
+                bool& slot = p.exclude ? result.exclude : result.include;
+                if (slot) continue;
+                const char* subject = p.icase ? folded.data() : name;
+                slot = p.kind == Kind::Exact
+                    ? len == p.literal.size() && std::memcmp(subject, p.literal.data(), len) == 0
+                    : p.literal.empty() || memmem(subject, len, p.literal.data(), p.literal.size());
+            }
+            return result;
+        }
+
+        // Called once per entry from every reader thread, so sets too large
+        // for the stack reuse a per-thread buffer rather than allocating.
+        uint64_t small[2 * 8];
+        uint64_t* state = small;
+        if (words > 8) {
+            thread_local std::vector<uint64_t> large;
+            if (large.size() < 2 * words) large.resize(2 * words);
+            state = large.data();
+        }
+        uint64_t* next = state + words;
+        std::memcpy(state, initial.data(), words * sizeof(uint64_t));
+
+        for (size_t i = 0; i < len; ++i) {
+            const uint64_t* mask = &char_masks[static_cast<unsigned char>(name[i]) * words];
+            uint64_t carry = 0;
+            uint64_t alive = 0;
+            for (size_t k = 0; k < words; ++k) {
+                uint64_t w = state[k];
+                next[k] = (((w << 1) | carry) & mask[k]) | (w & stars[k]);
+                carry = w >> 63;
+                alive |= next[k];
+            }
+            if (!alive) return result;
+            close_over_stars(next);
+            std::swap(state, next);
+        }
+
+        for (size_t k = 0; k < words; ++k) {
+            if (state[k] & include_accept[k]) result.include = true;
+            if (state[k] & exclude_accept[k]) result.exclude = true;
+        }
+        return result;
+    }
+
+private:
+    struct Token {
+        bool star = false;
+        std::bitset<256> chars;
+    };
+
+    struct Parsed {
+        std::vector<Token> tokens;
+        std::string literal; // lowercased when icase
+        Kind kind = Kind::Glob;
+        bool icase = false;
+        bool exclude = false;
+    };
+
+    std::vector<Parsed> patterns;
+    size_t words = 0;
+    std::vector<uint64_t> char_masks; // 256 rows of `words` words
+    std::vector<uint64_t> start;
+    std::vector<uint64_t> stars;
+    std::vector<uint64_t> include_accept;
+    std::vector<uint64_t> exclude_accept;
+    std::vector<uint64_t> initial;
+    bool literal_fast_path = false;
+    bool fold_name = false;
+
+    static void set_bit(std::vector<uint64_t>& set, size_t bit) {
+        set[bit / 64] |= 1ULL << (bit % 64);
+    }
+
+    // A star may match nothing, so it is live as soon as its predecessor is.
+    void close_over_stars(uint64_t* state) const {
+        uint64_t carry = 0;
+        for (size_t k = 0; k < words; ++k) {
+            uint64_t w = state[k];
+            state[k] |= ((w << 1) | carry) & stars[k];
+            carry = w >> 63;
+        }
+    }
+
+    static Token star_token() {
+        Token token;
+        token.star = true;
+        return token;
+    }
+
+    static void add_char(Token& token, unsigned char c, bool icase) {
+        token.chars.set(c);
+        if (icase) {
+            token.chars.set(static_cast<unsigned char>(std::tolower(c)));
+            token.chars.set(static_cast<unsigned char>(std::toupper(c)));
+        }
+    }
+
+    static Token char_token(unsigned char c, bool icase) {
+        Token token;
+        add_char(token, c, icase);
+        return token;
+    }
+
+    static void parse_glob(const std::string& glob, bool icase, std::vector<Token>& tokens) {
+        for (size_t i = 0; i < glob.size(); ++i) {
+            unsigned char c = glob[i];
+            if (c == '*') {
+                tokens.push_back(star_token());
+            } else if (c == '?') {
+                Token token;
+                token.chars.set();
+                tokens.push_back(token);
+            } else if (c == '[') {
+                size_t end = i;
+                Token token;
+                if (parse_class(glob, end, icase, token)) {
+                    tokens.push_back(token);
+                    i = end;
+                } else {
+                    tokens.push_back(char_token(c, icase));
+                }
+            } else if (c == '\\' && i + 1 < glob.size()) {
+                tokens.push_back(char_token(glob[++i], icase));
+            } else {
+                tokens.push_back(char_token(c, icase));
+            }
+        }
+    }
+
+    // Parses the class starting at glob[pos] == '['. On success `pos` is
+    // left on the closing ']'; an unterminated class is a literal '['.
+    static bool parse_class(const std::string& glob, size_t& pos, bool icase, Token& token) {
+        size_t i = pos + 1;
+        bool negate = false;
+        if (i < glob.size() && (glob[i] == '!' || glob[i] == '^')) {
+            negate = true;
+            i++;
+        }
+
+        bool first = true;
+        for (; i < glob.size(); ++i) {
+            unsigned char c = glob[i];
+            if (c == ']' && !first) break;
+            first = false;
+
+            if (c == '\\' && i + 1 < glob.size()) c = glob[++i];
+            if (i + 2 < glob.size() && glob[i + 1] == '-' && glob[i + 2] != ']') {
+                unsigned char hi = glob[i + 2];
+                for (unsigned v = c; v <= hi; ++v) add_char(token, static_cast<unsigned char>(v), icase);
+                i += 2;
+            } else {
+                add_char(token, c, icase);
+            }
+        }
+        if (i >= glob.size()) return false;
+
+        if (negate) token.chars.flip();
+        pos = i;
+        return true;
+    }
+};
+
+// --gitignore: the rules of one .gitignore file, layered over those of the
+// directories above it. Each file is parsed once, when its directory is
+// read; the layer is immutable after that and shared by every listing below
+// it. A deeper layer overrides its parents and, within a layer, the last
+// matching rule wins, as in git. Supports !negation, trailing / for
+// directories only, anchoring by a leading or inner /, and ** across
+// directories.
+class IgnoreRules {
+public:
+    // `base_depth` is the depth of the directory holding the file.
+    IgnoreRules(std::shared_ptr<const IgnoreRules> parent, int base_depth)
+        : parent(std::move(parent)), base_depth(base_depth) {}
+
+    void parse(std::string_view text) {
+        while (!text.empty()) {
+            size_t end = text.find('\n');
+            std::string_view line = text.substr(0, end);
+            text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
+            add_line(line);
+        }
+    }
+
+    bool empty() const { return rules.empty(); }
+
+    // Whether `name`, in a directory at `depth`, is ignored by this layer or
+    // the ones above it. `path_below(d)` returns that directory's path below
+    // its ancestor at depth d; it is only called for anchored rules of a
+    // shallower .gitignore.
+    template <typename PathBelow>
+    bool ignored(int depth, PathBelow&& path_below, std::string_view name, bool is_dir) const {
+        std::string scratch;
+        for (const IgnoreRules* layer = this; layer; layer = layer->parent.get()) {
+            int verdict = layer->match(depth, path_below, name, is_dir, scratch);
+            if (verdict >= 0) return verdict != 0;
+        }
+        return false;
+    }
+
+private:
+    enum class Kind {
+        Literal, // no wildcards: compared as is
+        Suffix,  // *<literal>, the usual *.o
+        Glob
+    };
+
+    struct Rule {
+        std::string pattern;
+        Kind kind = Kind::Glob;
+        bool negate = false;
+        bool dir_only = false;
+        bool anchored = false; // matched against the path below the base
+    };
+
+    std::shared_ptr<const IgnoreRules> parent;
+    int base_depth;
+    std::vector<Rule> rules;
+
+    void add_line(std::string_view line) {
+        if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+        // Trailing spaces are dropped unless escaped.
+        while (!line.empty() && line.back() == ' ' &&
+               !(line.size() > 1 && line[line.size() - 2] == '\\')) {
+            line.remove_suffix(1);
+        }
+        if (line.empty() || line[0] == '#') return;
+
+        Rule rule;
+        if (line[0] == '!') {
+            rule.negate = true;
+            line.remove_prefix(1);
+        } else if (line[0] == '\\' && line.size() > 1 && (line[1] == '!' || line[1] == '#')) {
+            line.remove_prefix(1);
+        }
+        if (!line.empty() && line.back() == '/') {
+            rule.dir_only = true;
+            line.remove_suffix(1);
+        }
+        if (line.find('/') != std::string_view::npos) {
+            rule.anchored = true;
+            if (line[0] == '/') line.remove_prefix(1);
+        }
+        if (line.empty()) return;
+
+        rule.pattern.assign(line.data(), line.size());
+        bool wild = line.find_first_of("*?[\\") != std::string_view::npos;
+        bool tail_wild = line.substr(1).find_first_of("*?[\\") != std::string_view::npos;
+        if (!wild) {
+            rule.kind = Kind::Literal;
+        } else if (!rule.anchored && line[0] == '*' && !tail_wild) {
+            rule.kind = Kind::Suffix;
+            rule.pattern.erase(0, 1);
+        }
+        rules.push_back(std::move(rule));
+    }
+
+    // 1 if ignored, 0 if re-included by a negated rule, -1 if no rule here
+    // matches.
+    template <typename PathBelow>
+    int match(int depth, PathBelow& path_below, std::string_view name, bool is_dir,
+              std::string& scratch) const {
+        bool have_path = false;
+
+        for (auto it = rules.rbegin(); it != rules.rend(); ++it) {
+            const Rule& rule = *it;
+            if (rule.dir_only && !is_dir) continue;
+
+            std::string_view subject = name;
+            if (rule.anchored && depth > base_depth) {
+                if (!have_path) {
+                    scratch = path_below(base_depth);
+                    scratch += '/';
+                    scratch.append(name.data(), name.size());
+                    have_path = true;
+                }
+                subject = scratch;
+            }
+
+            bool hit;
+            switch (rule.kind) {
+            case Kind::Literal:
+                hit = subject == rule.pattern;
+                break;
+            case Kind::Suffix:
+                hit = subject.size() >= rule.pattern.size() &&
+                      subject.compare(subject.size() - rule.pattern.size(),
+                                      rule.pattern.size(), rule.pattern) == 0;
+                break;
+            default:
+                hit = wildmatch(rule.pattern.data(), rule.pattern.data(),
+                                rule.pattern.data() + rule.pattern.size(),
+                                subject.data(), subject.data() + subject.size());
+                break;
+            }
+            if (hit) return rule.negate ? 0 : 1;
+        }
+        return -1;
+    }
+
+    // Glob match of [p, pe) against [t, te) where * and ? stop at '/' and a
+    // whole ** component matches any number of directories.
+    static bool wildmatch(const char* begin, const char* p, const char* pe,
+                          const char* t, const char* te) {
+        while (p < pe) {
+            char c = *p;
+            if (c == '*') {
+                bool component = (p == begin || p[-1] == '/') &&
+                                 p + 1 < pe && p[1] == '*' && (p + 2 == pe || p[2] == '/');
+                if (component) {
+                    if (p + 2 == pe) return true;
+                    p += 3;
+                    for (const char* s = t;;) {
+                        if (wildmatch(begin, p, pe, s, te)) return true;
+                        s = static_cast<const char*>(std::memchr(s, '/', static_cast<size_t>(te - s)));
+                        if (!s) return false;
+                        s++;
+                    }
+                }
+                while (p < pe && *p == '*') p++;
+                for (const char* s = t;; ++s) {
+                    if (wildmatch(begin, p, pe, s, te)) return true;
+                    if (s == te || *s == '/') return false;
+                }
+            }
+            if (t == te) return false;
+            if (*t == '/' && (c == '?' || c == '[')) return false;
+            if (c == '?') {
+                p++;
+            } else if (c == '[') {
+                const char* q = p + 1;
+                bool negate = q < pe && (*q == '!' || *q == '^');
+                if (negate) q++;
+                bool found = false;
+                bool first = true;
+                for (; q < pe && (*q != ']' || first); ++q) {
+                    first = false;
+                    unsigned char lo = static_cast<unsigned char>(*q);
+                    if (lo == '\\' && q + 1 < pe) lo = static_cast<unsigned char>(*++q);
+                    unsigned char hi = lo;
+                    if (q + 2 < pe && q[1] == '-' && q[2] != ']') {
+                        hi = static_cast<unsigned char>(q[2]);
+                        q += 2;
+                    }
+                    unsigned char ch = static_cast<unsigned char>(*t);
+                    if (ch >= lo && ch <= hi) found = true;
+                }
+                if (q >= pe) {
+                    // Unterminated: a literal '['.
+                    if (*t != '[') return false;
+                    p++;
+                } else {
+                    if (found == negate) return false;
+                    p = q + 1;
+                }
+            } else {
+                if (c == '\\' && p + 1 < pe) c = *++p;
+                if (*t != c) return false;
+                p++;
+            }
+            t++;
+        }
+        return t == te;
+    }
+};
+
+// On-disk layout of a --save snapshot: a header, one SnapshotNode per entry
+// in breadth-first order (so every directory's children are contiguous and
+// sorted by name), then a string arena holding names and symlink targets.
+// --fromfile maps the file and walks it in place.
+struct SnapshotHeader {
+    char magic[8];           // "TREESNAP"
+    uint32_t version;
+    uint32_t node_count;
+    uint64_t nodes_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+};
+
+struct SnapshotNode {
+    uint64_t size;
+    uint64_t blocks;         // 512-byte units, as in st_blocks
+    int64_t mtime;
+    uint64_t inode;
+    uint64_t dev;
+    uint32_t mode;
+    uint32_t nlink;
+    uint32_t name_offset;
+    uint32_t name_len;
+    uint32_t target_offset;
+    uint32_t target_len;
+    uint32_t first_child;
+    uint32_t child_count;
+    uint8_t type;            // d_type of the entry itself
+    uint8_t flags;           // SNAP_* bits
+    uint8_t reserved[6];
+};
+
+const char SNAPSHOT_MAGIC[8] = {'T', 'R', 'E', 'E', 'S', 'N', 'A', 'P'};
+const uint32_t SNAPSHOT_VERSION = 2;
+
+enum : uint8_t {
+    SNAP_IS_DIR = 1,      // directory, or symlink to one
+    SNAP_IS_SYMLINK = 2,
+    SNAP_HAS_STAT = 4,    // size, blocks, mode, nlink, mtime, inode, dev are valid
+    SNAP_UNREADABLE = 8,  // directory that could not be opened
+};
+
+// A snapshot file mapped read-only. Offsets read from the file are checked
+// before use, so a truncated or corrupt file yields empty directories
+// rather than out-of-bounds reads.
+class Snapshot {
+public:
+    Snapshot() = default;
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator=(const Snapshot&) = delete;
+
+    ~Snapshot() {
+        if (data) munmap(const_cast<char*>(data), length);
+    }
+
+    bool open(const std::string& path, std::string& error) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            error = std::strerror(errno);
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(SnapshotHeader))) {
+            ::close(fd);
+            error = "not a snapshot file";
+            return false;
+        }
+        length = static_cast<size_t>(st.st_size);
+        void* mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) {
+            error = std::strerror(errno);
+            return false;
+        }
+        data = static_cast<const char*>(mapped);
+
+        std::memcpy(&header, data, sizeof(header));
+        if (std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+            header.version != SNAPSHOT_VERSION) {
+            error = "not a snapshot file or unsupported version";
+            return false;
+        }
+        if (header.node_count == 0 ||
+            header.nodes_offset % alignof(SnapshotNode) != 0 ||
+            header.nodes_offset > length ||
+            (length - header.nodes_offset) / sizeof(SnapshotNode) < header.node_count ||
+            header.strings_offset > length ||
+            length - header.strings_offset < header.strings_size) {
+            error = "snapshot file is truncated";
+            return false;
+        }
+        nodes = reinterpret_cast<const SnapshotNode*>(data + header.nodes_offset);
+        strings = data + header.strings_offset;
+        return true;
+    }
+
+    uint32_t size() const { return header.node_count; }
+
+    const SnapshotNode& node(uint32_t index) const { return nodes[index]; }
+
+    bool has_children(const SnapshotNode& n) const {
+        return n.first_child <= header.node_count &&
+               n.child_count <= header.node_count - n.first_child;
+    }
+
+    std::string_view string(uint32_t offset, uint32_t len) const {
+        if (offset > header.strings_size || len > header.strings_size - offset) return {};
+        return std::string_view(strings + offset, len);
+    }
+
+    std::string_view name(const SnapshotNode& n) const { return string(n.name_offset, n.name_len); }
+    std::string_view target(const SnapshotNode& n) const { return string(n.target_offset, n.target_len); }
+
+private:
+    const char* data = nullptr;
+    size_t length = 0;
+    SnapshotHeader header{};
+    const SnapshotNode* nodes = nullptr;
+    const char* strings = nullptr;
+};
+
+// --cache: the raw listing of every directory scanned, keyed by its
+// (st_dev, st_ino) and valid for as long as its mtime and ctime are
+// unchanged. Listings are kept unfiltered, with every entry stat'ed and
+// every link target read, so one cache serves any set of options. Entries
+// reuse the snapshot node layout with offsets into a per-listing arena.
+struct CacheStamp {
+    uint64_t dev;
+    uint64_t inode;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+
+    bool operator==(const CacheStamp& other) const {
+        return dev == other.dev && inode == other.inode &&
+               mtime_sec == other.mtime_sec && mtime_nsec == other.mtime_nsec &&
+               ctime_sec == other.ctime_sec && ctime_nsec == other.ctime_nsec;
+    }
+};
+
+struct CachedListing {
+    CacheStamp stamp;
+    std::vector<SnapshotNode> nodes;
+    std::string strings;
+
+    std::string_view string(uint32_t offset, uint32_t len) const {
+        if (offset > strings.size() || len > strings.size() - offset) return {};
+        return std::string_view(strings.data() + offset, len);
+    }
+};
+
+const char CACHE_MAGIC[8] = {'T', 'R', 'E', 'E', 'C', 'A', 'C', 'H'};
+const uint32_t CACHE_VERSION = 1;
+
+// The cache file: magic, version, listing count, then per listing its stamp,
+// node count and string size followed by the nodes and the strings. It is
+// read whole at start-up and rewritten through a rename at exit. Lookups
+// and stores may come from any walker thread.
+class ScanCache {
+public:
+    static CacheStamp stamp_of(const struct stat& st) {
+        return {static_cast<uint64_t>(st.st_dev), static_cast<uint64_t>(st.st_ino),
+                static_cast<int64_t>(st.st_mtim.tv_sec), static_cast<int64_t>(st.st_mtim.tv_nsec),
+                static_cast<int64_t>(st.st_ctim.tv_sec), static_cast<int64_t>(st.st_ctim.tv_nsec)};
+    }
+
+    // A missing cache file is an empty cache; an unreadable one is an error.
+    bool load(const std::string& dir, std::string& error) {
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+            error = "cannot create " + dir + ": " + std::strerror(errno);
+            return false;
+        }
+        file = dir;
+        if (file.back() != '/') file += '/';
+        file += "tree.cache";
+        started = static_cast<int64_t>(time(nullptr));
+
+        std::ifstream stream(file, std::ios::binary);
+        if (!stream) return true;
+        std::string data((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+
+        size_t pos = 0;
+        auto take = [&](void* dest, size_t len) {
+            if (data.size() - pos < len) return false;
+            std::memcpy(dest, data.data() + pos, len);
+            pos += len;
+            return true;
+        };
+        char magic[8];
+        uint32_t version = 0;
+        uint64_t count = 0;
+        if (!take(magic, sizeof(magic)) || std::memcmp(magic, CACHE_MAGIC, sizeof(magic)) != 0 ||
+            !take(&version, sizeof(version)) || version != CACHE_VERSION ||
+            !take(&count, sizeof(count))) {
+            error = file + " is not a tree cache";
+            return false;
+        }
+        for (uint64_t i = 0; i < count; ++i) {
+            auto listing = std::make_shared<CachedListing>();
+            uint64_t node_count = 0;
+            uint64_t strings_size = 0;
+            if (!take(&listing->stamp, sizeof(CacheStamp)) ||
+                !take(&node_count, sizeof(node_count)) || !take(&strings_size, sizeof(strings_size)) ||
+                node_count > (data.size() - pos) / sizeof(SnapshotNode)) {
+                break;
+            }
+            listing->nodes.resize(node_count);
+            if (!take(listing->nodes.data(), node_count * sizeof(SnapshotNode)) ||
+                strings_size > data.size() - pos) {
+                break;
+            }
+            listing->strings.assign(data.data() + pos, strings_size);
+            pos += strings_size;
+            listings[{listing->stamp.dev, listing->stamp.inode}] = std::move(listing);
+        }
+        return true;
+    }
+
+    // Returns the cached listing for a directory with this stamp, if any.
+    std::shared_ptr<const CachedListing> lookup(const CacheStamp& stamp) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = listings.find({stamp.dev, stamp.inode});
+        if (it != listings.end() && it->second->stamp == stamp) {
+            hit_count++;
+            used.insert(it->first);
+            return it->second;
+        }
+        miss_count++;
+        return nullptr;
+    }
+
+    // Directories changed in the last second before the scan started are
+    // not stored: a later change within the same timestamp tick would go
+    // unnoticed.
+    void store(std::shared_ptr<const CachedListing> listing) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto key = std::make_pair(listing->stamp.dev, listing->stamp.inode);
+        used.insert(key);
+        if (std::max(listing->stamp.mtime_sec, listing->stamp.ctime_sec) >= started - 1) {
+            if (listings.erase(key)) dirty = true;
+            return;
+        }
+        listings[key] = std::move(listing);
+        dirty = true;
+    }
+
+    // Listings this run neither used nor stored are dropped first, so
+    // directories that are gone do not pile up. A run that covers less of
+    // the tree, under -D say, also drops what it did not reach.
+    bool save(std::string& error) {
+        for (auto it = listings.begin(); it != listings.end();) {
+            if (used.count(it->first)) {
+                ++it;
+            } else {
+                it = listings.erase(it);
+                dirty = true;
+            }
+        }
+        if (!dirty) return true;
+        std::string temp = file + ".tmp";
+        std::ofstream stream(temp, std::ios::binary | std::ios::trunc);
+        uint64_t count = listings.size();
+        stream.write(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+        stream.write(reinterpret_cast<const char*>(&CACHE_VERSION), sizeof(CACHE_VERSION));
+        stream.write(reinterpret_cast<const char*>(&count), sizeof(count));
+        for (const auto& item : listings) {
+            const CachedListing& listing = *item.second;
+            uint64_t node_count = listing.nodes.size();
+            uint64_t strings_size = listing.strings.size();
+            stream.write(reinterpret_cast<const char*>(&listing.stamp), sizeof(CacheStamp));
+            stream.write(reinterpret_cast<const char*>(&node_count), sizeof(node_count));
+            stream.write(reinterpret_cast<const char*>(&strings_size), sizeof(strings_size));
+            stream.write(reinterpret_cast<const char*>(listing.nodes.data()),
+                         static_cast<std::streamsize>(node_count * sizeof(SnapshotNode)));
+            stream.write(listing.strings.data(), static_cast<std::streamsize>(strings_size));
+        }
+        stream.close();
+        if (!stream || rename(temp.c_str(), file.c_str()) != 0) {
+            error = "could not write " + file;
+            unlink(temp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    uint64_t hits() const { return hit_count; }
+    uint64_t misses() const { return miss_count; }
+
+private:
+    struct KeyHash {
+        size_t operator()(const std::pair<uint64_t, uint64_t>& key) const {
+            return std::hash<uint64_t>()(key.first * 0x9e3779b97f4a7c15ULL ^ key.second);
+        }
+    };
+
+    std::string file;
+    int64_t started = 0;
+    std::mutex mutex;
+    std::unordered_map<std::pair<uint64_t, uint64_t>, std::shared_ptr<const CachedListing>, KeyHash> listings;
+    std::unordered_set<std::pair<uint64_t, uint64_t>, KeyHash> used; // looked up or stored this run
+    uint64_t hit_count = 0;
+    uint64_t miss_count = 0;
+    bool dirty = false;
+};
+
+#ifdef TREE_HAVE_URING
+// --uring: statx requests submitted through a private io_uring, so all the
+// metadata of one directory is fetched in a few system calls and the kernel
+// can overlap the lookups. The ring is driven with the raw syscalls; there is
+// no liburing dependency. One ring per thread, created on first use.
+class StatxRing {
+public:
+    struct Request {
+        int dir_fd;
+        const char* name;
+        int flags;             // AT_SYMLINK_NOFOLLOW or 0
+        struct statx* result;
+        int error;             // 0 or an errno value, set by run()
+    };
+
+    StatxRing() = default;
+    StatxRing(const StatxRing&) = delete;
+    StatxRing& operator=(const StatxRing&) = delete;
+
+    ~StatxRing() {
+        if (sqes) munmap(sqes, sqes_size);
+        if (cq_ring && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+        if (sq_ring) munmap(sq_ring, sq_ring_size);
+        if (ring_fd >= 0) close(ring_fd);
+    }
+
+    bool open(unsigned depth) {
+        struct io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, depth, &params));
+        if (ring_fd < 0) return false;
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+
+        sq_ring = map(sq_ring_size, IORING_OFF_SQ_RING);
+        if (!sq_ring) return false;
+        cq_ring = single_mmap ? sq_ring : map(cq_ring_size, IORING_OFF_CQ_RING);
+        if (!cq_ring) return false;
+        sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = static_cast<struct io_uring_sqe*>(map(sqes_size, IORING_OFF_SQES));
+        if (!sqes) return false;
+
+        char* sq = static_cast<char*>(sq_ring);
+        sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        char* cq = static_cast<char*>(cq_ring);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+        capacity = params.sq_entries;
+        return supports_statx();
+    }
+
+    // Runs every request, `capacity` at a time. Returns false if the ring
+    // itself failed; requests from the failed batch on are left unrun, and
+    // the ring is dead() from then on.
+    bool run(Request* requests, size_t count) {
+        if (failed) return false;
+        for (size_t done = 0; done < count;) {
+            unsigned batch = static_cast<unsigned>(std::min<size_t>(count - done, capacity));
+            unsigned tail = *sq_tail;
+            for (unsigned i = 0; i < batch; ++i) {
+                const Request& request = requests[done + i];
+                unsigned slot = (tail + i) & sq_mask;
+                struct io_uring_sqe& sqe = sqes[slot];
+                std::memset(&sqe, 0, sizeof(sqe));
+                sqe.opcode = IORING_OP_STATX;
+                sqe.fd = request.dir_fd;
+                sqe.addr = reinterpret_cast<uint64_t>(request.name);
+                sqe.len = STATX_BASIC_STATS;
+                sqe.addr2 = reinterpret_cast<uint64_t>(request.result);
+                sqe.statx_flags = static_cast<uint32_t>(request.flags);
+                sqe.user_data = done + i;
+                sq_array[slot] = slot;
+            }
+            __atomic_store_n(sq_tail, tail + batch, __ATOMIC_RELEASE);
+
+            unsigned submitted = 0;
+            unsigned completed = 0;
+            while (completed < batch) {
+                unsigned to_submit = batch - submitted;
+                long ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, batch - completed,
+                                   IORING_ENTER_GETEVENTS, nullptr, 0);
+                if (ret < 0) {
+                    if (errno == EINTR) continue;
+                    drain(tail, completed);
+                    failed = true;
+                    return false;
+                }
+                submitted += static_cast<unsigned>(ret);
+
+                unsigned head = *cq_head;
+                unsigned ready = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+                for (; head != ready; ++head, ++completed) {
+                    const struct io_uring_cqe& cqe = cqes[head & cq_mask];
+                    requests[cqe.user_data].error = cqe.res < 0 ? -cqe.res : 0;
+                }
+                __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            }
+            done += batch;
+        }
+        return true;
+    }
+
+    bool dead() const { return failed; }
+
+private:
+    // Waits for every request of the batch submitted at `tail` that the
+    // kernel has taken, so none is left to write into the caller's buffers
+    // or to post a completion a later run() would take for its own. Those
+    // still in the submission queue are never entered again.
+    void drain(unsigned tail, unsigned completed) {
+        unsigned taken = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) - tail;
+        while (completed < taken) {
+            if (syscall(__NR_io_uring_enter, ring_fd, 0, taken - completed,
+                        IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR) {
+                sched_yield(); // completions still arrive; just wait for them
+            }
+            unsigned head = *cq_head;
+            unsigned ready = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            completed += ready - head;
+            __atomic_store_n(cq_head, ready, __ATOMIC_RELEASE);
+        }
+    }
+
+    // Kernels before 5.6 set up a ring but fail every STATX with EINVAL.
+    // They cannot answer the probe either, which is how they are told apart.
+    bool supports_statx() {
+        constexpr unsigned OPS = 256;
+        std::vector<char> buffer(sizeof(struct io_uring_probe) + OPS * sizeof(struct io_uring_probe_op));
+        auto* probe = reinterpret_cast<struct io_uring_probe*>(buffer.data());
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, OPS) < 0) {
+            return false;
+        }
+        return IORING_OP_STATX <= probe->last_op &&
+               (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    int ring_fd = -1;
+    void* sq_ring = nullptr;
+    void* cq_ring = nullptr;
+    size_t sq_ring_size = 0;
+    size_t cq_ring_size = 0;
+    struct io_uring_sqe* sqes = nullptr;
+    size_t sqes_size = 0;
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned sq_mask = 0;
+    unsigned* sq_array = nullptr;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    struct io_uring_cqe* cqes = nullptr;
+    unsigned capacity = 0;
+    bool failed = false;
+
+    void* map(size_t size, off_t offset) {
+        void* mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring_fd, offset);
+        return mapped == MAP_FAILED ? nullptr : mapped;
+    }
+};
+#endif
+
+// XXH64 of `len` bytes. Only compared within one run, so byte order is
+// whatever the machine reads.
+inline uint64_t xxhash64(const void* data, size_t len, uint64_t seed) {
+    constexpr uint64_t P1 = 0x9E3779B185EBCA87ULL;
+    constexpr uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+    constexpr uint64_t P3 = 0x165667B19E3779F9ULL;
+    constexpr uint64_t P4 = 0x85EBCA77C2B2AE63ULL;
+    constexpr uint64_t P5 = 0x27D4EB2F165667C5ULL;
+    auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+    auto read64 = [](const unsigned char* p) { uint64_t v; std::memcpy(&v, p, 8); return v; };
+    auto read32 = [](const unsigned char* p) { uint32_t v; std::memcpy(&v, p, 4); return v; };
+    auto round = [&](uint64_t acc, uint64_t input) { return rotl(acc + input * P2, 31) * P1; };
+    auto merge = [&](uint64_t acc, uint64_t lane) { return (acc ^ round(0, lane)) * P1 + P4; };
+
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    const unsigned char* end = p + len;
+    uint64_t h;
+    if (len >= 32) {
+        uint64_t v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+        for (; end - p >= 32; p += 32) {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+        }
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge(merge(merge(merge(h, v1), v2), v3), v4);
+    } else {
+        h = seed + P5;
+    }
+    h += len;
+    for (; end - p >= 8; p += 8) h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+    if (end - p >= 4) {
+        h = rotl(h ^ (read32(p) * P1), 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; ++p) h = rotl(h ^ (*p * P5), 11) * P1;
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+// --dupes: finds the regular files with identical contents among those a
+// walk has kept. Files are bucketed by size first, so a file whose size no
+// other file has is never opened, and its path is never even built. Within
+// a bucket each file's first and last 4 KiB are hashed, and only files whose
+// samples still collide are hashed whole, through mmap or 1 MiB reads.
+// Files whose hashes agree are then compared byte for byte. Each round
+// spreads its work over a pool of threads. Hard links to one inode are one
+// file, not duplicates.
+class DupeFinder {
+public:
+    // `node` is whatever the caller names the file by; run() asks for its
+    // path only if the file has to be read.
+    void add(uint32_t node, uint64_t size, uint64_t dev, uint64_t inode) {
+        if (size == 0) return; // nothing to reclaim
+        File file;
+        file.node = node;
+        file.size = size;
+        file.dev = dev;
+        file.inode = inode;
+        file.order = static_cast<uint32_t>(files.size());
+        files.push_back(file);
+    }
+
+    // Compares everything added so far on `threads` threads. path_of(node)
+    // returns the path of a file from the working directory.
+    template <typename PathOf>
+    void run(size_t threads, PathOf path_of) {
+        // One File per inode; the other names only count.
+        std::sort(files.begin(), files.end(), [](const File& a, const File& b) {
+            if (a.dev != b.dev) return a.dev < b.dev;
+            if (a.inode != b.inode) return a.inode < b.inode;
+            return a.order < b.order;
+        });
+        size_t unique = 0;
+        for (size_t i = 0; i < files.size(); ++i) {
+            if (unique && files[unique - 1].dev == files[i].dev &&
+                files[unique - 1].inode == files[i].inode) {
+                files[unique - 1].names++;
+            } else {
+                files[unique++] = files[i];
+            }
+        }
+        files.resize(unique);
+
+        // Sizes only one inode has are settled without reading anything.
+        std::sort(files.begin(), files.end(), [](const File& a, const File& b) {
+            return a.size != b.size ? a.size < b.size : a.order < b.order;
+        });
+        std::vector<File*> candidates;
+        for_each_run(files, [](const File& a, const File& b) { return a.size == b.size; },
+                     [&](File* first, File* last) {
+                         if (last - first < 2) return;
+                         for (File* f = first; f != last; ++f) {
+                             f->path = path_of(f->node);
+                             candidates.push_back(f);
+                         }
+                     });
+        parallel_for(candidates.size(), threads, [&](size_t i) { hash_sample(*candidates[i]); });
+
+        // Files the sample covered whole are settled; the others whose
+        // samples collide are read in full.
+        auto same_sample = [](const File& a, const File& b) {
+            return a.size == b.size && a.sample == b.sample;
+        };
+        std::sort(files.begin(), files.end(), [](const File& a, const File& b) {
+            if (a.size != b.size) return a.size < b.size;
+            if (a.sample != b.sample) return a.sample < b.sample;
+            return a.order < b.order;
+        });
+        candidates.clear();
+        for_each_run(files, same_sample, [&](File* first, File* last) {
+            if (last - first < 2 || !first->sample) return;
+            for (File* f = first; f != last; ++f) {
+                if (f->size <= 2 * SAMPLE) {
+                    f->hash = f->sample;
+                } else {
+                    candidates.push_back(f);
+                }
+            }
+        });
+        parallel_for(candidates.size(), threads, [&](size_t i) { hash_contents(*candidates[i]); });
+
+        // Files with the same hash are compared with the first of them; any
+        // that differ are compared among themselves the same way.
+        std::sort(files.begin(), files.end(), [](const File& a, const File& b) {
+            if (a.size != b.size) return a.size < b.size;
+            if (a.sample != b.sample) return a.sample < b.sample;
+            if (a.hash != b.hash) return a.hash < b.hash;
+            return a.order < b.order;
+        });
+        std::vector<std::vector<File*>> runs;
+        for_each_run(files,
+                     [&](const File& a, const File& b) { return same_sample(a, b) && a.hash == b.hash; },
+                     [&](File* first, File* last) {
+                         if (last - first < 2 || !first->hash) return;
+                         runs.emplace_back();
+                         for (File* f = first; f != last; ++f) runs.back().push_back(f);
+                     });
+        std::vector<std::vector<std::vector<File*>>> verified(runs.size());
+        parallel_for(runs.size(), threads, [&](size_t i) { verified[i] = split_identical(runs[i]); });
+
+        // Groups are numbered by where their first file appears in the walk.
+        std::vector<std::vector<File*>> groups;
+        for (auto& split : verified) {
+            for (auto& group : split) {
+                if (group.size() >= 2) groups.push_back(std::move(group));
+            }
+        }
+        std::sort(groups.begin(), groups.end(),
+                  [](const auto& a, const auto& b) { return a.front()->order < b.front()->order; });
+        for (size_t g = 0; g < groups.size(); ++g) {
+            for (File* f : groups[g]) {
+                members.push_back({f->dev, f->inode, static_cast<uint32_t>(g + 1)});
+                group_files += f->names;
+            }
+            reclaimable_bytes += groups[g].front()->size * (groups[g].size() - 1);
+        }
+        group_total = groups.size();
+        std::sort(members.begin(), members.end());
+
+        std::vector<File>().swap(files);
+    }
+
+    // Group of the file with this identity, from 1, or 0 if it has no copy.
+    uint32_t group_of(uint64_t dev, uint64_t inode) const {
+        auto it = std::lower_bound(members.begin(), members.end(), Member{dev, inode, 0});
+        return it != members.end() && it->dev == dev && it->inode == inode ? it->group : 0;
+    }
+
+    size_t groups() const { return group_total; }
+    size_t files_in_groups() const { return group_files; } // hard links included
+    uint64_t reclaimable() const { return reclaimable_bytes; }
+
+private:
+    static constexpr size_t SAMPLE = 4096;            // bytes at each end
+    static constexpr size_t CHUNK = size_t(1) << 20;  // files are read 1 MiB at a time
+
+    // A sample or hash is empty until the file has been read successfully.
+    struct File {
+        uint32_t node = 0;
+        uint64_t size = 0;
+        uint64_t dev = 0;
+        uint64_t inode = 0;
+        uint32_t order = 0; // in walk order
+        uint32_t names = 1; // hard links seen
+        std::string path;   // for files that are read
+        std::optional<uint64_t> sample;
+        std::optional<uint64_t> hash;
+    };
+
+    struct Member {
+        uint64_t dev;
+        uint64_t inode;
+        uint32_t group;
+
+        bool operator<(const Member& other) const {
+            return dev != other.dev ? dev < other.dev : inode < other.inode;
+        }
+    };
+
+    struct FreeDeleter {
+        void operator()(char* p) const { free(p); }
+    };
+
+    // Read access to one file: mapped when possible, else one aligned
+    // chunk-sized buffer filled with pread.
+    class Contents {
+    public:
+        Contents(const File& file) : size(file.size) {
+            fd = open(file.path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+            if (fd < 0) return;
+            struct stat st;
+            if (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) != size) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        ~Contents() {
+            if (mapped) munmap(mapped, size);
+            if (fd >= 0) close(fd);
+        }
+        Contents(const Contents&) = delete;
+        Contents& operator=(const Contents&) = delete;
+
+        // Opened, and still the size the walk saw.
+        bool ok() const { return fd >= 0; }
+
+        bool read(char* buffer, size_t len, uint64_t offset) const {
+            while (len > 0) {
+                ssize_t n = pread(fd, buffer, len, static_cast<off_t>(offset));
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return false;
+                buffer += n;
+                len -= static_cast<size_t>(n);
+                offset += static_cast<uint64_t>(n);
+            }
+            return true;
+        }
+
+        // Calls fn(data, len) on each chunk in order; false if a read fails
+        // or fn returns false.
+        template <typename Fn>
+        bool each_chunk(Fn fn) {
+            if (const char* data = map()) {
+                for (uint64_t at = 0; at < size; at += CHUNK) {
+                    if (!fn(data + at, static_cast<size_t>(std::min<uint64_t>(CHUNK, size - at)))) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+            if (!buffer) {
+                void* block = nullptr;
+                if (posix_memalign(&block, 4096, CHUNK) != 0) return false;
+                buffer.reset(static_cast<char*>(block));
+            }
+            for (uint64_t at = 0; at < size; at += CHUNK) {
+                size_t len = static_cast<size_t>(std::min<uint64_t>(CHUNK, size - at));
+                if (!read(buffer.get(), len, at) || !fn(buffer.get(), len)) return false;
+            }
+            return true;
+        }
+
+        // The whole file, or null if it cannot be mapped.
+        const char* map() {
+            if (!mapped) {
+                void* at = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (at == MAP_FAILED) return nullptr;
+                mapped = at;
+                madvise(mapped, size, MADV_SEQUENTIAL);
+            }
+            return static_cast<const char*>(mapped);
+        }
+
+    private:
+        uint64_t size;
+        int fd = -1;
+        void* mapped = nullptr;
+        std::unique_ptr<char, FreeDeleter> buffer;
+    };
+
+    std::vector<File> files;
+    std::vector<Member> members; // sorted by identity
+    size_t group_total = 0;
+    size_t group_files = 0;
+    uint64_t reclaimable_bytes = 0;
+
+    // Calls `visit(first, last)` for each run of neighbours `same` holds for.
+    template <typename Same, typename Visit>
+    static void for_each_run(std::vector<File>& list, Same same, Visit visit) {
+        for (size_t i = 0; i < list.size();) {
+            size_t j = i + 1;
+            while (j < list.size() && same(list[i], list[j])) ++j;
+            visit(list.data() + i, list.data() + j);
+            i = j;
+        }
+    }
+
+    // Runs fn(0) .. fn(count - 1), each index once, on up to `threads`
+    // threads including the caller.
+    template <typename Fn>
+    static void parallel_for(size_t count, size_t threads, Fn fn) {
+        std::atomic<size_t> next{0};
+        auto work = [&] {
+            for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < count;) fn(i);
+        };
+        std::vector<std::thread> pool;
+        for (size_t t = 1; t < std::min(threads, count); ++t) pool.emplace_back(work);
+        work();
+        for (auto& thread : pool) thread.join();
+    }
+
+    // Hashes the first and last SAMPLE bytes, which for a file of up to
+    // twice that is all of it.
+    static void hash_sample(File& file) {
+        Contents contents(file);
+        if (!contents.ok()) return;
+        char buffer[2 * SAMPLE];
+        size_t head = static_cast<size_t>(std::min<uint64_t>(file.size, SAMPLE));
+        size_t tail = static_cast<size_t>(std::min<uint64_t>(file.size - head, SAMPLE));
+        if (contents.read(buffer, head, 0) && contents.read(buffer + head, tail, file.size - tail)) {
+            file.sample = xxhash64(buffer, head + tail, file.size);
+        }
+    }
+
+    // Hashes the whole file a chunk at a time, each chunk seeded with the
+    // hash so far.
+    static void hash_contents(File& file) {
+        Contents contents(file);
+        if (!contents.ok()) return;
+        uint64_t h = file.size;
+        bool ok = contents.each_chunk([&](const char* data, size_t len) {
+            h = xxhash64(data, len, h);
+            return true;
+        });
+        if (ok) file.hash = h;
+    }
+
+    // Byte comparison of two files of the same size.
+    static bool same_contents(const File& a, const File& b) {
+        Contents left(a);
+        Contents right(b);
+        if (!left.ok() || !right.ok()) return false;
+        const char* other = right.map();
+        if (other) {
+            uint64_t at = 0;
+            return left.each_chunk([&](const char* data, size_t len) {
+                bool same = std::memcmp(data, other + at, len) == 0;
+                at += len;
+                return same;
+            });
+        }
+        std::unique_ptr<char[]> buffer(new char[CHUNK]);
+        uint64_t at = 0;
+        return left.each_chunk([&](const char* data, size_t len) {
+            bool same = right.read(buffer.get(), len, at) && std::memcmp(data, buffer.get(), len) == 0;
+            at += len;
+            return same;
+        });
+    }
+
+    // Splits files whose hashes agree into sets of byte-identical ones. With
+    // no collision that is one comparison per file against the first.
+    static std::vector<std::vector<File*>> split_identical(const std::vector<File*>& run) {
+        std::vector<std::vector<File*>> sets;
+        for (File* file : run) {
+            bool placed = false;
+            for (auto& set : sets) {
+                if (same_contents(*set.front(), *file)) {
+                    set.push_back(file);
+                    placed = true;
+                    break;
+                }
+            }
+            if (!placed) sets.push_back({file});
+        }
+        return sets;
+    }
+};
+
+// Totals for the summary line, kept per thread and merged.
+struct FileStats {
+    size_t directories = 0;
+    size_t files = 0;
+    size_t symlinks = 0;
+    size_t executables = 0;
+    uintmax_t total_size = 0;
+    size_t size_filtered_files = 0; // count of files within size range
+
+    void merge(const FileStats& other) {
+        directories += other.directories;
+        files += other.files;
+        symlinks += other.symlinks;
+        executables += other.executables;
+        total_size += other.total_size;
+        size_filtered_files += other.size_filtered_files;
+    }
+
+    void subtract(const FileStats& other) {
+        directories -= other.directories;
+        files -= other.files;
+        symlinks -= other.symlinks;
+        executables -= other.executables;
+        total_size -= other.total_size;
+        size_filtered_files -= other.size_filtered_files;
+    }
+};
+
+// One visible entry as the walk yields it, in display order. The views point
+// into the walker's own listings and are only valid during the callback.
+struct EntryRecord {
+    int depth;                   // 1 for entries directly under the root
+    std::string_view name;
+    std::string_view target;     // symlink target, empty otherwise
+    unsigned char type;          // d_type of the entry itself
+    bool is_dir;                 // directory, or symlink to one
+    bool is_symlink;
+    bool is_last;                // last visible entry of its directory
+    bool has_stat;               // the fields from size to inode are valid
+    bool recursive;              // -L link back onto the current path
+    uint64_t size;
+    uint64_t blocks;             // 512-byte units, as in st_blocks
+    uint32_t mode;
+    int64_t mtime;
+    uint64_t dev;
+    uint64_t inode;
+    uint64_t du_apparent;        // --du: size of the subtree, or of the file
+    uint64_t du_allocated;
+};
+
+// Receives the entries of a walk. The CLI's line renderer is one of these.
+class EntryVisitor {
+public:
+    virtual ~EntryVisitor() = default;
+    virtual void visit(const EntryRecord& record) = 0;
+};
+
+// The walker behind the command line. Everything in `Options` is honoured;
+// visit_tree() hands the visible entries to any EntryVisitor, and print()
+// renders them as the familiar tree through the built-in one.
+class TreePrinter : public EntryVisitor {
+private:
+    // Escape sequences and tree glyphs are fixed at compile time; each
+    // render_entry<> specialization picks its table by template argument.
+    static constexpr std::string_view COLOR_RESET = "\033[0m";
+    static constexpr std::string_view COLOR_DIR = "\033[1;34m";     // blue
+    static constexpr std::string_view COLOR_FILE = "\033[0;37m";    // white
+    static constexpr std::string_view COLOR_SYMLINK = "\033[1;36m"; // idk
+    static constexpr std::string_view COLOR_EXEC = "\033[1;32m";    // green
+    static constexpr std::string_view COLOR_ERROR = "\033[1;31m";   // red
+
+    // The connectors already carry their trailing "── ", and the prefix
+    // pieces their padding, so a line is written in whole pieces.
+    struct TreeGlyphs {
+        std::string_view junction; // entry with siblings after it
+        std::string_view corner;   // last entry of its directory
+        std::string_view vertical; // prefix under an ancestor with more siblings
+        std::string_view blank;    // prefix under a last ancestor
+    };
+
+    // Indexed by use_ascii.
+    static constexpr TreeGlyphs GLYPHS[2] = {
+        {"├── ", "└── ", "│   ", "    "},
+    #ifdef _WIN32
+        {"+-- ", "`-- ", "|   ", "    "},
+    #else
+        {"|-- ", "`-- ", "|   ", "    "},
+    #endif
+    };
+
+    // Options the line renderer and the visibility filter branch on. Each
+    // combination gets its own instantiation, chosen once per TreePrinter.
+    enum RenderFeature : unsigned {
+        RENDER_COLOR = 1u << 0,
+        RENDER_ASCII = 1u << 1,
+        RENDER_SIZE = 1u << 2,  // -s or -S
+        RENDER_PERMS = 1u << 3,
+        RENDER_DU = 1u << 4,
+        RENDER_DUPES = 1u << 5,
+        RENDER_COMBINATIONS = 1u << 6,
+    };
+
+    enum FilterFeature : unsigned {
+        FILTER_DIRS_ONLY = 1u << 0,
+        FILTER_SYMLINKS = 1u << 1,
+        FILTER_EXECUTABLES = 1u << 2,
+        FILTER_PATTERN = 1u << 3,
+        FILTER_SIZE = 1u << 4,
+        FILTER_COMBINATIONS = 1u << 5,
+    };
+
+    // Syscall counters reported by -v.
+    struct SyscallStats {
+        size_t entries = 0;
+        size_t dirs_opened = 0;
+        size_t dirs_reopened = 0; // openat() calls after DirFds closed a directory
+        size_t stat_calls = 0;
+        size_t readlink_calls = 0;
+        PhaseClock clock; // --profile
+
+        void merge(const SyscallStats& other) {
+            entries += other.entries;
+            dirs_opened += other.dirs_opened;
+            dirs_reopened += other.dirs_reopened;
+            stat_calls += other.stat_calls;
+            readlink_calls += other.readlink_calls;
+            clock.merge(other.clock);
+        }
+    };
+
+    // Counters owned by a single thread. Each reader thread keeps its own
+    // and they are summed once the walk is over.
+    struct WalkCounters {
+        FileStats stats;
+        SyscallStats sys_stats;
+
+        void merge(const WalkCounters& other) {
+            stats.merge(other.stats);
+            sys_stats.merge(other.sys_stats);
+        }
+    };
+
+    // Everything the filters, colorizers and formatters need to know about
+    // one directory entry, filled once when the directory is read.
+    struct Entry {
+        std::string name;
+        unsigned char type = DT_UNKNOWN; // d_type of the entry itself
+        bool is_dir = false;             // directory, or symlink to one
+        bool is_symlink = false;
+        bool has_stat = false;           // mode and size are valid
+        mode_t mode = 0;                 // of the link target for symlinks
+        uintmax_t size = 0;
+        uint64_t blocks = 0;             // 512-byte units
+        uint64_t nlink = 0;
+        int64_t mtime = 0;
+        uint64_t inode = 0;
+        uint64_t dev = 0;
+        bool pattern_hit = false;        // name matches some -P pattern
+        uint32_t snapshot_node = 0;      // index in the --fromfile snapshot
+        bool recursive = false;          // -L link back onto the current path
+        std::string target;              // link target, for visible symlinks
+    };
+
+    struct HardLink {
+        uint64_t dev;
+        uint64_t inode;
+        uint64_t apparent;
+        uint64_t allocated;
+    };
+
+    struct DevInodeHash {
+        size_t operator()(const std::pair<uint64_t, uint64_t>& key) const {
+            return std::hash<uint64_t>()(key.second * 0x9e3779b97f4a7c15ULL ^ key.first);
+        }
+    };
+
+    // --du-top candidate; the heap keeps the lightest on top.
+    struct DuTop {
+        uint64_t allocated;
+        uint64_t apparent;
+        std::string path;
+
+        bool operator>(const DuTop& other) const { return allocated > other.allocated; }
+    };
+
+    // Post-order modes keep every subtree they have resolved until it is
+    // printed. Its entries move here once their directory is decided: one
+    // record per entry as parallel arrays, 36 bytes without --du or --dupes, and the
+    // names and link targets in a bump-allocated arena. A directory's
+    // children are contiguous, ending at the one flagged LAST. Paths are
+    // rebuilt from the parent indices when an error message needs one.
+    class NodeStore {
+    public:
+        static constexpr uint32_t NONE = UINT32_MAX;
+
+        enum : uint8_t {
+            IS_DIR = 1,      // directory, or symlink to one
+            IS_SYMLINK = 2,  // the target follows the name in the arena
+            HAS_STAT = 4,
+            RECURSIVE = 8,   // -L link back onto the current path
+            LAST = 16,       // last child of its directory
+            UNREADABLE = 32, // a directory that could not be read
+        };
+
+        // Bytes held by every store of a walk, for --profile.
+        struct Usage {
+            size_t bytes = 0;
+            size_t peak_bytes = 0;
+            size_t nodes = 0;
+            size_t peak_nodes = 0;
+
+            void add(size_t more_bytes, size_t more_nodes) {
+                bytes += more_bytes;
+                nodes += more_nodes;
+                peak_bytes = std::max(peak_bytes, bytes);
+                peak_nodes = std::max(peak_nodes, nodes);
+            }
+        };
+
+        // The blocks, --du and identity columns are only kept when something
+        // reads them.
+        NodeStore(Usage& usage, bool with_blocks, bool with_du, bool with_ids)
+            : usage(usage), with_blocks(with_blocks), with_du(with_du), with_ids(with_ids) {}
+
+        ~NodeStore() {
+            usage.bytes -= bytes;
+            usage.nodes -= count;
+        }
+
+        NodeStore(const NodeStore&) = delete;
+        NodeStore& operator=(const NodeStore&) = delete;
+
+        uint32_t size() const { return count; }
+
+        // Appends a node and returns its index.
+        uint32_t add(std::string_view name, std::string_view target, uint8_t type, uint8_t flags,
+                     uint32_t mode, uint64_t size, uint64_t blocks, int64_t mtime,
+                     uint64_t dev, uint64_t inode) {
+            if (count == NONE) {
+                throw std::length_error("too many entries to hold in memory");
+            }
+            if (count == capacity) grow_columns();
+            uint32_t i = count++;
+            usage.add(0, 1);
+
+            bool link = (flags & IS_SYMLINK) != 0;
+            uint16_t target_len = static_cast<uint16_t>(std::min<size_t>(target.size(), UINT16_MAX));
+            size_t len = name.size() + (link ? sizeof(target_len) + target_len : 0);
+            char* at = allocate(len, name_offset[i]);
+            std::memcpy(at, name.data(), name.size());
+            if (link) {
+                std::memcpy(at + name.size(), &target_len, sizeof(target_len));
+                std::memcpy(at + name.size() + sizeof(target_len), target.data(), target_len);
+            }
+            name_len[i] = static_cast<uint16_t>(name.size());
+
+            parent_index[i] = NONE;
+            first_child_index[i] = NONE;
+            this->type[i] = type;
+            this->flags[i] = flags;
+            this->mode[i] = mode;
+            this->size_bytes[i] = size;
+            this->mtime[i] = mtime;
+            if (with_blocks) this->blocks[i] = blocks;
+            if (with_ids) {
+                this->dev[i] = dev;
+                this->inode[i] = inode;
+            }
+            if (with_du) {
+                du_apparent[i] = 0;
+                du_allocated[i] = 0;
+            }
+            return i;
+        }
+
+        // Makes [first, last] the children of `node`, or of nothing for NONE.
+        void adopt(uint32_t node, uint32_t first, uint32_t last) {
+            for (uint32_t i = first; i <= last; ++i) parent_index[i] = node;
+        }
+
+        void set_first_child(uint32_t node, uint32_t first) { first_child_index[node] = first; }
+        void set_flag(uint32_t node, uint8_t flag) { flags[node] |= flag; }
+        void set_du(uint32_t node, uint64_t apparent, uint64_t allocated) {
+            if (!with_du) return;
+            du_apparent[node] = apparent;
+            du_allocated[node] = allocated;
+        }
+
+        std::string_view name(uint32_t node) const {
+            return std::string_view(arena_at(name_offset[node]), name_len[node]);
+        }
+        std::string_view target(uint32_t node) const {
+            if (!(flags[node] & IS_SYMLINK)) return std::string_view();
+            const char* at = arena_at(name_offset[node]) + name_len[node];
+            uint16_t len;
+            std::memcpy(&len, at, sizeof(len));
+            return std::string_view(at + sizeof(len), len);
+        }
+        uint32_t parent(uint32_t node) const { return parent_index[node]; }
+        uint32_t first_child(uint32_t node) const { return first_child_index[node]; }
+        uint8_t node_type(uint32_t node) const { return type[node]; }
+        uint8_t node_flags(uint32_t node) const { return flags[node]; }
+        uint32_t node_mode(uint32_t node) const { return mode[node]; }
+        uint64_t node_size(uint32_t node) const { return size_bytes[node]; }
+        uint64_t node_blocks(uint32_t node) const { return with_blocks ? blocks[node] : 0; }
+        int64_t node_mtime(uint32_t node) const { return mtime[node]; }
+        uint64_t node_dev(uint32_t node) const { return with_ids ? dev[node] : 0; }
+        uint64_t node_inode(uint32_t node) const { return with_ids ? inode[node] : 0; }
+        uint64_t node_du_apparent(uint32_t node) const { return with_du ? du_apparent[node] : 0; }
+        uint64_t node_du_allocated(uint32_t node) const { return with_du ? du_allocated[node] : 0; }
+
+    private:
+        // Columns and the arena grow by blocks that double in size: appending
+        // never copies, a small subtree costs little, and the blocks stay few.
+        // Block k holds first << k items and starts at first * (2^k - 1).
+        static uint32_t block_of(uint64_t i, uint64_t first) {
+            return static_cast<uint32_t>(63 - __builtin_clzll(i / first + 1));
+        }
+        static uint64_t block_start(uint32_t k, uint64_t first) {
+            return first * ((uint64_t(1) << k) - 1);
+        }
+
+        static constexpr uint64_t COLUMN_FIRST = 256;  // nodes
+        static constexpr uint64_t ARENA_FIRST = 4096;  // bytes
+
+        template <typename T>
+        class Column {
+        public:
+            T& operator[](uint32_t i) { return at(i); }
+            const T& operator[](uint32_t i) const { return const_cast<Column*>(this)->at(i); }
+            size_t grow() {
+                size_t len = COLUMN_FIRST << blocks.size();
+                blocks.emplace_back(new T[len]);
+                return sizeof(T) * len;
+            }
+
+        private:
+            std::vector<std::unique_ptr<T[]>> blocks;
+
+            T& at(uint32_t i) {
+                uint32_t k = block_of(i, COLUMN_FIRST);
+                return blocks[k][i - block_start(k, COLUMN_FIRST)];
+            }
+        };
+
+        Usage& usage;
+        bool with_blocks;
+        bool with_du;
+        bool with_ids;
+        uint32_t count = 0;
+        uint64_t capacity = 0;
+        size_t bytes = 0;
+
+        Column<uint32_t> parent_index;
+        Column<uint32_t> first_child_index;
+        Column<uint32_t> name_offset;
+        Column<uint16_t> name_len;
+        Column<uint8_t> type;  // d_type of the entry itself
+        Column<uint8_t> flags;
+        Column<uint32_t> mode;
+        Column<uint64_t> size_bytes;
+        Column<int64_t> mtime;
+        Column<uint64_t> blocks;
+        Column<uint64_t> dev;
+        Column<uint64_t> inode;
+        Column<uint64_t> du_apparent;
+        Column<uint64_t> du_allocated;
+
+        // Names never straddle arena blocks; what is left of a block that
+        // cannot take the next name stays unused.
+        std::vector<std::unique_ptr<char[]>> arena;
+        uint64_t arena_used = 0; // offset of the next free byte
+
+        void grow_columns() {
+            size_t more = parent_index.grow() + first_child_index.grow() + name_offset.grow() +
+                          name_len.grow() + type.grow() + flags.grow() + mode.grow() +
+                          size_bytes.grow() + mtime.grow();
+            if (with_blocks) more += blocks.grow();
+            if (with_ids) more += dev.grow() + inode.grow();
+            if (with_du) more += du_apparent.grow() + du_allocated.grow();
+            capacity = block_start(block_of(capacity, COLUMN_FIRST) + 1, COLUMN_FIRST);
+            bytes += more;
+            usage.add(more, 0);
+        }
+
+        char* allocate(size_t len, uint32_t& offset) {
+            for (;;) {
+                uint64_t end = block_start(static_cast<uint32_t>(arena.size()), ARENA_FIRST);
+                if (end - arena_used >= len) break;
+                // Start the next block.
+                size_t block = ARENA_FIRST << arena.size();
+                if (end + block > UINT32_MAX) {
+                    throw std::length_error("names too large to hold in memory");
+                }
+                arena.emplace_back(new char[block]);
+                arena_used = end;
+                bytes += block;
+                usage.add(block, 0);
+            }
+            offset = static_cast<uint32_t>(arena_used);
+            arena_used += len;
+            return arena_at_mutable(offset);
+        }
+
+        char* arena_at_mutable(uint32_t offset) {
+            uint32_t k = block_of(offset, ARENA_FIRST);
+            return arena[k].get() + (offset - block_start(k, ARENA_FIRST));
+        }
+
+        const char* arena_at(uint32_t offset) const {
+            return const_cast<NodeStore*>(this)->arena_at_mutable(offset);
+        }
+    };
+
+    class DirFds;
+
+    // The visible entries of one directory in display order, with a slot
+    // per subdirectory that will be descended into. Under -j the worker
+    // pool fills these ahead of the printer; `ready` publishes the result.
+    struct DirListing {
+        std::string name; // the root's is the path it was given
+        int depth = 1;
+        uint32_t snapshot_node = 0;
+        // Identity of the directory itself, known when -L or -x needs it.
+        // The parent outlives this listing until it has been read.
+        DirListing* parent = nullptr;
+        bool has_id = false;
+        uint64_t dev = 0;
+        uint64_t inode = 0;
+        const uint64_t serial = next_serial(); // unique, unlike the address
+        // --gitignore: the rules in force for entries of this directory, its
+        // own .gitignore layered over its parent's. Null when there are none.
+        std::shared_ptr<const IgnoreRules> ignore;
+        bool ok = false;
+        std::vector<Entry> entries;
+        std::vector<std::unique_ptr<DirListing>> subdirs; // null for non-dirs
+        bool has_match = false; // a -P/-S match hidden by -d, -l or -e
+        // --du: bytes under this directory. Readers add the directory's own
+        // inode and its singly-linked files; the printer adds hard-linked
+        // files once each, then the subdirectories, in post-order.
+        uint64_t du_apparent = 0;
+        uint64_t du_allocated = 0;
+        std::vector<HardLink> hardlinks;
+        bool resolved = false;  // pruned, and so are all listings below
+        std::atomic<bool> ready{false};
+        // --watch: the inotify watch on this directory (-1 once it is gone)
+        // and the number of lines its entries and subtrees take up.
+        int watch = -1;
+        size_t lines = 0;
+        // Post-order: once decided, the entries and their subtrees move to a
+        // NodeStore, from `first_node` to `last_node`. The listing prune()
+        // started from owns the store.
+        std::unique_ptr<NodeStore> store;
+        bool compacted = false;
+        uint32_t first_node = NodeStore::NONE;
+        uint32_t last_node = NodeStore::NONE;
+        // A descriptor on this directory for opening its subdirectories,
+        // while DirFds holds one; the fields are DirFds's to manage.
+        int fd = -1;
+        bool borrowed = false;
+        size_t unopened = 0;    // subdirectories not opened yet
+        unsigned pins = 0;      // readers inside openat() on `fd`
+        DirListing* older = nullptr;
+        DirListing* newer = nullptr;
+        DirFds* fds = nullptr;
+
+        DirListing() = default;
+        DirListing(const DirListing&) = delete;
+
+        static uint64_t next_serial() {
+            static std::atomic<uint64_t> serials{0};
+            return serials.fetch_add(1, std::memory_order_relaxed);
+        }
+        DirListing& operator=(const DirListing&) = delete;
+        ~DirListing() {
+            if (fds) fds->forget(*this);
+        }
+    };
+
+    // -L: the (dev, ino) of a directory and of all its ancestors, so the
+    // cycle check is one exact lookup. Each reader thread keeps its own and
+    // moves it to the directory it is reading: levels are popped back to
+    // the deepest ancestor it still holds, and the rest pushed from there.
+    // A depth-first reader mostly moves by one level. Levels are matched by
+    // serial, since a listing that was left may be freed and its address
+    // reused.
+    class PathIds {
+    public:
+        void move_to(const DirListing& dir) {
+            chain.clear();
+            const DirListing* p = &dir;
+            for (; p; p = p->parent) {
+                size_t level = static_cast<size_t>(p->depth - 1);
+                if (level < levels.size() && levels[level].serial == p->serial) break;
+                chain.push_back(p);
+            }
+            size_t keep = p ? static_cast<size_t>(p->depth) : 0;
+            while (levels.size() > keep) {
+                if (levels.back().has_id) ids.erase({levels.back().dev, levels.back().inode});
+                levels.pop_back();
+            }
+            for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+                const DirListing& level = **it;
+                levels.push_back({level.serial, level.has_id, level.dev, level.inode});
+                if (level.has_id) ids.insert({level.dev, level.inode});
+            }
+        }
+
+        bool contains(uint64_t dev, uint64_t inode) const {
+            return ids.count({dev, inode}) != 0;
+        }
+
+    private:
+        struct Level {
+            uint64_t serial;
+            bool has_id;
+            uint64_t dev;
+            uint64_t inode;
+        };
+
+        std::vector<Level> levels; // levels[d] is at depth d + 1
+        std::unordered_set<std::pair<uint64_t, uint64_t>, DevInodeHash> ids;
+        std::vector<const DirListing*> chain; // scratch for move_to()
+    };
+
+    // Descriptors on directories whose subdirectories are still to be
+    // opened. Every directory below the root is opened with openat() on its
+    // parent, so no path handed to the kernel is longer than one name and
+    // depth is not bounded by PATH_MAX. At most `budget` descriptors are
+    // held: past that the least recently used one is closed, and when it is
+    // needed again it is reopened one level at a time from its nearest open
+    // ancestor. Shared by the -j readers.
+    class DirFds {
+    public:
+        // Keeps descriptors until this many subdirectories have been opened.
+        static constexpr size_t UNTIL_DROPPED = SIZE_MAX;
+
+        explicit DirFds(size_t budget) : budget(std::max<size_t>(budget, 1)) {}
+
+        ~DirFds() {
+            while (oldest) close_fd(*oldest);
+        }
+
+        DirFds(const DirFds&) = delete;
+        DirFds& operator=(const DirFds&) = delete;
+
+        // Opens `dir` for reading and returns a descriptor owned by the
+        // caller, or -1 with errno set.
+        int open(DirListing& dir, SyscallStats& sys_stats) {
+            if (!dir.parent) return ::open(dir.name.c_str(), DIR_FLAGS);
+            DirListing& parent = *dir.parent;
+            int parent_fd = acquire(parent, sys_stats);
+            int fd = parent_fd < 0 ? -1 : openat(parent_fd, dir.name.c_str(), DIR_FLAGS);
+            int error = errno;
+            std::lock_guard<std::mutex> guard(lock);
+            if (parent.unopened != 0 && parent.unopened != UNTIL_DROPPED) parent.unopened--;
+            if (parent_fd >= 0) unpin(parent);
+            errno = error;
+            return fd;
+        }
+
+        // Holds `fd`, a descriptor on `dir`, until `subdirs` subdirectories
+        // have been opened through open() or until drop(). A `borrowed`
+        // descriptor belongs to the caller: it is never closed here, and
+        // does not count against the budget.
+        void keep(DirListing& dir, int fd, size_t subdirs, bool borrowed = false) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (dir.fd >= 0) close_fd(dir);
+            dir.unopened = subdirs;
+            dir.borrowed = borrowed;
+            insert(dir, fd);
+            evict();
+        }
+
+        void drop(DirListing& dir) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (dir.fd >= 0) close_fd(dir);
+            dir.unopened = 0;
+        }
+
+        // For ~DirListing().
+        void forget(DirListing& dir) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (dir.fd >= 0) close_fd(dir);
+        }
+
+    private:
+        static constexpr int DIR_FLAGS = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+
+        size_t budget;
+        size_t owned = 0;             // descriptors counting against the budget
+        DirListing* oldest = nullptr; // LRU list of listings holding a descriptor
+        DirListing* newest = nullptr;
+        std::mutex lock;
+
+        // Returns a descriptor on `dir`, pinned until unpin(), reopening it
+        // if it was closed; -1 if it cannot be reopened.
+        int acquire(DirListing& dir, SyscallStats& sys_stats) {
+            // Closed directories from `dir` up, and whether to keep each.
+            std::vector<std::pair<DirListing*, bool>> chain;
+            DirListing* held = nullptr; // pinned, the one to openat() on
+            int fd = -1;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if (dir.fd >= 0) {
+                    pin(dir);
+                    return dir.fd;
+                }
+                size_t keep = budget / 2;
+                for (DirListing* p = &dir; p; p = p->parent) {
+                    if (p->fd >= 0) {
+                        held = p;
+                        pin(*held);
+                        fd = held->fd;
+                        break;
+                    }
+                    bool wanted = p == &dir || (p->unopened != 0 && keep > 0);
+                    if (wanted && keep > 0) keep--;
+                    chain.push_back({p, wanted});
+                }
+            }
+
+            // Reopen downwards, the root by its path. The nearest directories
+            // that still have subdirectories to open are kept, up to half the
+            // budget, since the walk is heading back up through them; runs
+            // of the others are crossed with one openat() on a relative path
+            // of up to PATH_MAX bytes.
+            std::string path;
+            int transient = -1;
+            for (size_t k = chain.size(); k-- > 0;) {
+                DirListing& next = *chain[k].first;
+                bool keep = chain[k].second;
+                if (!path.empty()) path += '/';
+                path += next.name;
+                if (!keep && path.size() + chain[k - 1].first->name.size() < PATH_MAX - 1) continue;
+
+                int opened = held || transient >= 0 ? openat(fd, path.c_str(), DIR_FLAGS)
+                                                    : ::open(path.c_str(), DIR_FLAGS);
+                sys_stats.dirs_reopened++;
+                path.clear();
+                if (transient >= 0) ::close(transient);
+                transient = -1;
+
+                std::lock_guard<std::mutex> guard(lock);
+                if (held) unpin(*held);
+                held = nullptr;
+                if (opened < 0) return -1;
+                if (!keep) {
+                    transient = fd = opened;
+                    continue;
+                }
+                if (next.fd >= 0) {
+                    // Another reader reopened it meanwhile.
+                    ::close(opened);
+                } else {
+                    insert(next, opened);
+                }
+                pin(next);
+                held = &next;
+                fd = next.fd;
+                evict();
+            }
+            return fd;
+        }
+
+        void insert(DirListing& dir, int fd) {
+            dir.fd = fd;
+            dir.fds = this;
+            if (!dir.borrowed) owned++;
+            link_newest(dir);
+        }
+
+        void link_newest(DirListing& dir) {
+            dir.older = newest;
+            dir.newer = nullptr;
+            if (newest) newest->newer = &dir;
+            newest = &dir;
+            if (!oldest) oldest = &dir;
+        }
+
+        void unlink(DirListing& dir) {
+            (dir.older ? dir.older->newer : oldest) = dir.newer;
+            (dir.newer ? dir.newer->older : newest) = dir.older;
+            dir.older = dir.newer = nullptr;
+        }
+
+        void pin(DirListing& dir) {
+            dir.pins++;
+            unlink(dir);
+            link_newest(dir);
+        }
+
+        // A descriptor nobody is waiting on any more is closed right away.
+        void unpin(DirListing& dir) {
+            dir.pins--;
+            if (dir.pins == 0 && dir.unopened == 0 && dir.fd >= 0) close_fd(dir);
+        }
+
+        void close_fd(DirListing& dir) {
+            unlink(dir);
+            if (dir.borrowed) {
+                dir.borrowed = false;
+            } else {
+                ::close(dir.fd);
+                owned--;
+            }
+            dir.fd = -1;
+            dir.fds = nullptr;
+        }
+
+        void evict() {
+            for (DirListing* p = oldest; p && owned > budget;) {
+                DirListing* next = p->newer;
+                if (p->pins == 0 && !p->borrowed) close_fd(*p);
+                p = next;
+            }
+        }
+    };
+
+    Options opts;
+    WalkCounters counters;
+    PathIds path_ids; // -L, for the reads done on this thread
+    DirFds dir_fds;
+    NodeStore::Usage store_usage; // --profile
+    GlobSet globs;
+    std::unique_ptr<Snapshot> snapshot; // set when rendering from a file
+    std::unique_ptr<ScanCache> cache;   // set for --cache when reading the filesystem
+    std::unordered_set<std::pair<uint64_t, uint64_t>, DevInodeHash> du_seen; // (dev, ino)
+    std::priority_queue<DuTop, std::vector<DuTop>, std::greater<DuTop>> du_heaviest;
+    uint64_t root_dev = 0; // for -x
+    uint64_t started_ns = 0; // --profile
+    std::unique_ptr<DupeFinder> dupes; // --dupes, once the files are compared
+    // --watch: the inotify descriptor, the listings behind each watch (under
+    // -L one inode can be reached by several paths) and the lines on screen.
+    int inotify_fd = -1;
+    std::unordered_map<int, std::vector<DirListing*>> watched;
+    std::vector<std::string> frame;
+    std::vector<std::string> summary;
+    OutputWriter out;
+    std::string prefix; // glyphs (--ndjson: path) of the open ancestors of the next line
+    std::vector<size_t> prefix_levels{0};
+    int json_depth = 0; // -J: depth of the entry whose object is still open
+    EntryVisitor* visitor = this;
+    const TreeGlyphs& glyphs;
+    void (TreePrinter::*renderer)(const EntryRecord&); // renderer_for(opts)
+    bool (TreePrinter::*visibility)(const Entry&);     // visible_as<filter_features()>
+
+    void setup_console() {
+        #ifdef _WIN32
+        SetConsoleOutputCP(CP_UTF8);
+        
+        HANDLE hOut = GetStdHandle(STD_OUTPUT_HANDLE);
+        DWORD dwMode = 0;
+        GetConsoleMode(hOut, &dwMode);
+        dwMode |= ENABLE_VIRTUAL_TERMINAL_PROCESSING;
+        SetConsoleMode(hOut, dwMode);
+        #endif
+    }
+
+    // Writes the nine rwx characters for `mode` into `out`.
+    void format_permissions(bool has_stat, mode_t mode, char* out) {
+        std::memset(out, '-', 9);
+        if (!has_stat) return;
+
+        if (mode & S_IRUSR) out[0] = 'r';
+        if (mode & S_IWUSR) out[1] = 'w';
+        if (mode & S_IXUSR) out[2] = 'x';
+
+        if (mode & S_IRGRP) out[3] = 'r';
+        if (mode & S_IWGRP) out[4] = 'w';
+        if (mode & S_IXGRP) out[5] = 'x';
+
+        if (mode & S_IROTH) out[6] = 'r';
+        if (mode & S_IWOTH) out[7] = 'w';
+        if (mode & S_IXOTH) out[8] = 'x';
+    }
+
+    bool is_executable(const Entry& entry) {
+        return entry.has_stat && (entry.mode & S_IXUSR);
+    }
+
+    int stat_at(int dir_fd, const char* name, struct stat* st, int flags,
+                SyscallStats& sys_stats) {
+        sys_stats.stat_calls++;
+        return fstatat(dir_fd, name, st, flags);
+    }
+
+    static void fill_from_stat(Entry& entry, const struct stat& st) {
+        entry.is_dir = S_ISDIR(st.st_mode);
+        entry.has_stat = true;
+        entry.mode = st.st_mode;
+        entry.size = static_cast<uintmax_t>(st.st_size);
+        entry.blocks = static_cast<uint64_t>(st.st_blocks);
+        entry.nlink = static_cast<uint64_t>(st.st_nlink);
+        entry.mtime = static_cast<int64_t>(st.st_mtime);
+        entry.inode = static_cast<uint64_t>(st.st_ino);
+        entry.dev = static_cast<uint64_t>(st.st_dev);
+    }
+
+    // Fills in everything the filters and formatters will ask about an
+    // entry. Regular files and symlinks cost one fstatat; directories cost
+    // nothing unless their mode is displayed or `full` asks for it. Only
+    // DT_UNKNOWN symlinks, which need an lstat to be recognised, take two.
+    void load_entry(int dir_fd, Entry& entry, SyscallStats& sys_stats, bool full = false) {
+        ScopedPhase phase(sys_stats.clock, Phase::Metadata);
+        struct stat st;
+        unsigned char type = entry.type;
+
+        if (type == DT_UNKNOWN) {
+            if (stat_at(dir_fd, entry.name.c_str(), &st, AT_SYMLINK_NOFOLLOW, sys_stats) != 0) return;
+            if (S_ISLNK(st.st_mode)) {
+                type = DT_LNK;
+            } else {
+                entry.type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+                fill_from_stat(entry, st);
+                return;
+            }
+        }
+
+        if (type == DT_LNK) {
+            entry.type = DT_LNK;
+            entry.is_symlink = true;
+            // Follow the link: directories behind it are descended into
+            // and the target's mode and size are what gets displayed.
+            if (stat_at(dir_fd, entry.name.c_str(), &st, 0, sys_stats) != 0) return;
+        } else if (type == DT_DIR) {
+            entry.is_dir = true;
+            if (!stats_dirs() && !full) return;
+            if (stat_at(dir_fd, entry.name.c_str(), &st, AT_SYMLINK_NOFOLLOW, sys_stats) != 0) return;
+        } else {
+            if (stat_at(dir_fd, entry.name.c_str(), &st, AT_SYMLINK_NOFOLLOW, sys_stats) != 0) return;
+        }
+
+        fill_from_stat(entry, st);
+    }
+
+    size_t format_size(uintmax_t size, char* buffer, size_t buffer_len) {
+        const char* units[] = {"B", "K", "M", "G", "T"};
+        int unit_index = 0;
+        double size_f = static_cast<double>(size);
+        
+        while (size_f >= 1024.0 && unit_index < 4) {
+            size_f /= 1024.0;
+            unit_index++;
+        }
+        
+        int len;
+        if (unit_index == 0) {
+            len = snprintf(buffer, buffer_len, "%5ju%s", size, units[unit_index]);
+        } else {
+            len = snprintf(buffer, buffer_len, "%5.1f%s", size_f, units[unit_index]);
+        }
+        return static_cast<size_t>(len);
+    }
+
+    std::string format_size(uintmax_t size) {
+        char buffer[32];
+        return std::string(buffer, format_size(size, buffer, sizeof(buffer)));
+    }
+
+    bool size_in_range(uintmax_t size) {
+        return size >= opts.min_size && size <= opts.max_size;
+    }
+
+    bool is_size_in_range(const Entry& entry) {
+        if (!opts.size_filter) return true;
+        if (entry.is_dir) return true;
+        return entry.has_stat && size_in_range(entry.size);
+    }
+
+    // True for entries that satisfy -P and -S on their own. Directories only
+    // match by name, and only for -P; otherwise they are kept when something
+    // below them matches.
+    bool matches_filters(const Entry& entry) {
+        if (entry.is_dir) {
+            return opts.pattern_match && !opts.size_filter && entry.pattern_hit;
+        }
+        return (!opts.pattern_match || entry.pattern_hit) && is_size_in_range(entry);
+    }
+
+    // -P and -S hide directories that lead to no match, which can only be
+    // decided once their subtree has been read.
+    bool prunes_dirs() const {
+        return opts.pattern_match || opts.size_filter;
+    }
+
+    // -L and -x compare directories by (st_dev, st_ino), so those are stat'ed.
+    bool needs_dir_ids() const {
+        return opts.follow_symlinks || opts.one_filesystem;
+    }
+
+    // Directories are stat'ed only when something shows or compares their
+    // metadata; d_type alone is enough to descend.
+    bool stats_dirs() const {
+        return opts.show_perms || opts.du || needs_dir_ids() || opts.sort != SortOrder::Name ||
+               opts.format != OutputFormat::Tree;
+    }
+
+    // Modes whose directory lines depend on the whole subtree below them:
+    // those subtrees are read to the bottom and resolved before printing.
+    // --dupes resolves the whole tree, as any file may have a copy anywhere.
+    bool post_order() const {
+        return prunes_dirs() || opts.du || opts.dupes;
+    }
+
+    // Post-order modes that decide directories at the -D limit from what
+    // lies below it. --dupes only compares files it shows.
+    bool reads_below_depth() const {
+        return prunes_dirs() || opts.du;
+    }
+
+    // Readers count entries as they go unless the printer counts them
+    // (post-order) or --top may still drop some after sorting.
+    bool counts_while_reading() const {
+        return !post_order() && !opts.top;
+    }
+
+    // Decides visibility from the entry record alone. Directories always
+    // pass here; pruning them is up to prune().
+    bool is_visible(const Entry& entry) {
+        return (this->*visibility)(entry);
+    }
+
+    // is_visible() for one combination of -d, -l, -e, -P and -S; the
+    // options that are off cost nothing.
+    template <unsigned F>
+    bool visible_as(const Entry& entry) {
+        if (entry.is_dir) return true;
+        if constexpr ((F & FILTER_DIRS_ONLY) != 0) return false;
+        if constexpr ((F & FILTER_SYMLINKS) != 0) {
+            if (!entry.is_symlink) return false;
+        }
+        if constexpr ((F & FILTER_EXECUTABLES) != 0) {
+            if (!is_executable(entry)) return false;
+        }
+        if constexpr ((F & FILTER_PATTERN) != 0) {
+            if (!entry.pattern_hit) return false;
+        }
+        if constexpr ((F & FILTER_SIZE) != 0) {
+            return entry.has_stat && size_in_range(entry.size);
+        }
+        return true;
+    }
+
+    static unsigned filter_features(const Options& options) {
+        return (options.dirs_only ? FILTER_DIRS_ONLY : 0u) |
+               (options.only_symlinks ? FILTER_SYMLINKS : 0u) |
+               (options.only_executables ? FILTER_EXECUTABLES : 0u) |
+               (options.pattern_match ? FILTER_PATTERN : 0u) |
+               (options.size_filter ? FILTER_SIZE : 0u);
+    }
+
+    template <unsigned... F>
+    static auto select_filter(unsigned features, std::integer_sequence<unsigned, F...>) {
+        static constexpr bool (TreePrinter::*table[])(const Entry&) = {&TreePrinter::visible_as<F>...};
+        return table[features];
+    }
+
+    void count_entry(const Entry& entry, FileStats& stats) {
+        if (entry.is_symlink) {
+            stats.symlinks++;
+        } else if (entry.is_dir) {
+            stats.directories++;
+        } else {
+            stats.files++;
+            if (opts.size_filter && is_size_in_range(entry)) {
+                stats.size_filtered_files++;
+            }
+            if (is_executable(entry)) {
+                stats.executables++;
+            }
+        }
+
+        if ((opts.show_size || opts.size_filter) && !entry.is_dir && entry.has_stat) {
+            stats.total_size += entry.size;
+        }
+    }
+
+    static void append_path(std::string& path, std::string_view name) {
+        if (path.empty() || path.back() != '/') path += '/';
+        path += name;
+    }
+
+    // Listings hold only their own name; full paths are built when a
+    // message, the cache or inotify needs one.
+    static std::string path_of(const DirListing& dir) {
+        std::vector<const DirListing*> chain;
+        for (const DirListing* p = &dir; p; p = p->parent) chain.push_back(p);
+        std::string path = chain.back()->name;
+        for (size_t k = chain.size() - 1; k-- > 0;) append_path(path, chain[k]->name);
+        return path;
+    }
+
+    // Path of `dir` below its ancestor at `depth`, without a leading '/'.
+    static std::string path_below(const DirListing& dir, int depth) {
+        std::vector<const DirListing*> chain;
+        for (const DirListing* p = &dir; p && p->depth > depth; p = p->parent) chain.push_back(p);
+        std::string path;
+        for (size_t k = chain.size(); k-- > 0;) {
+            if (!path.empty()) path += '/';
+            path += chain[k]->name;
+        }
+        return path;
+    }
+
+    // --gitignore: .git itself is always skipped, like git does.
+    bool gitignored(const DirListing& dir, std::string_view name, bool is_dir) const {
+        if (name == ".git") return true;
+        if (!dir.ignore) return false;
+        auto below = [&](int depth) { return path_below(dir, depth); };
+        return dir.ignore->ignored(dir.depth, below, name, is_dir);
+    }
+
+    // --gitignore: sets dir.ignore to the parent's rules with the directory's
+    // own .gitignore, if any, layered on top. `dir_fd` is the open directory,
+    // or AT_FDCWD to go by path. Called on every (re)read of the directory.
+    void load_ignore_rules(DirListing& dir, int dir_fd) {
+        dir.ignore = dir.parent ? dir.parent->ignore : nullptr;
+
+        std::string path = ".gitignore";
+        if (dir_fd == AT_FDCWD) {
+            path = path_of(dir);
+            append_path(path, ".gitignore");
+        }
+        int fd = openat(dir_fd, path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return;
+        std::string text;
+        char buf[4096];
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof(buf))) > 0) text.append(buf, static_cast<size_t>(n));
+        close(fd);
+
+        auto rules = std::make_shared<IgnoreRules>(dir.ignore, dir.depth);
+        rules->parse(text);
+        if (!rules->empty()) dir.ignore = std::move(rules);
+    }
+
+    // Checks that need only the name and type. Returns false for entries that
+    // are never shown whatever their metadata; fills `match` otherwise.
+    bool admit_name(const DirListing& dir, const char* name, size_t len, unsigned char type,
+                    GlobSet::Match& match, SyscallStats& sys_stats) {
+        ScopedPhase phase(sys_stats.clock, Phase::Filter);
+        if (name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.'))) return false;
+        if (!opts.show_all && name[0] == '.') return false;
+        sys_stats.entries++;
+
+        // Without a d_type, directory-only rules wait for admit_entry().
+        if (opts.gitignore && gitignored(dir, std::string_view(name, len), type == DT_DIR)) {
+            return false;
+        }
+
+        match = globs.match(name, len);
+        if (match.exclude) return false;
+
+        // Plain files can never show up under -d, nor under -P unless they
+        // match; skip their stat. --du still has to charge them.
+        if (opts.dirs_only && type == DT_REG && !post_order()) return false;
+        if (opts.pattern_match && !match.include && type == DT_REG && !opts.du) return false;
+        return true;
+    }
+
+    // Checks that need the metadata. Entries hidden by -d, -l or -e that
+    // still match -P/-S set the listing's has_match; under --du every entry
+    // that got this far is charged to the listing whether shown or not.
+    bool admit_entry(const Entry& entry, DirListing& dir) {
+        if (opts.gitignore && entry.is_dir && !entry.is_symlink &&
+            gitignored(dir, entry.name, true)) {
+            return false;
+        }
+        if (opts.du) account_du(entry, dir);
+        if (is_visible(entry)) return true;
+        if (prunes_dirs() && matches_filters(entry)) dir.has_match = true;
+        return false;
+    }
+
+    // Symlinks are not charged (their target is, where it lives), and a
+    // directory's own inode is charged to its subdirectory listing.
+    void account_du(const Entry& entry, DirListing& dir) {
+        if (entry.is_symlink || entry.is_dir || !entry.has_stat) return;
+        uint64_t allocated = entry.blocks * 512;
+        if (entry.nlink > 1) {
+            dir.hardlinks.push_back({entry.dev, entry.inode, entry.size, allocated});
+        } else {
+            dir.du_apparent += entry.size;
+            dir.du_allocated += allocated;
+        }
+    }
+
+    // Reads entries from `handle` until one is visible and fills `entry` with
+    // it. Returns false at the end of the directory.
+    bool read_entry(DIR* handle, Entry& entry, DirListing& dir, WalkCounters& local) {
+        int dir_fd = dirfd(handle);
+
+        while (struct dirent* de = readdir(handle)) {
+            const char* name = de->d_name;
+            GlobSet::Match match;
+            if (!admit_name(dir, name, std::strlen(name), de->d_type, match, local.sys_stats)) continue;
+
+            entry = Entry();
+            entry.name = name;
+            entry.type = de->d_type;
+            entry.pattern_hit = match.include;
+            load_entry(dir_fd, entry, local.sys_stats);
+
+            if (!admit_entry(entry, dir)) continue;
+
+            if (entry.is_symlink) read_link(dir_fd, entry, local.sys_stats);
+            return true;
+        }
+        return false;
+    }
+
+#ifdef TREE_HAVE_URING
+    static void fill_from_statx(Entry& entry, const struct statx& stx) {
+        struct stat st;
+        std::memset(&st, 0, sizeof(st));
+        st.st_mode = stx.stx_mode;
+        st.st_size = static_cast<off_t>(stx.stx_size);
+        st.st_blocks = static_cast<blkcnt_t>(stx.stx_blocks);
+        st.st_nlink = stx.stx_nlink;
+        st.st_mtime = stx.stx_mtime.tv_sec;
+        st.st_ino = stx.stx_ino;
+        st.st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+        fill_from_stat(entry, st);
+    }
+
+    // The calling thread's ring, or null where io_uring is unavailable. A
+    // ring that has failed once is closed, and the thread stats with
+    // fstatat from then on.
+    static StatxRing* uring() {
+        thread_local std::unique_ptr<StatxRing> ring;
+        thread_local bool tried = false;
+        if (!tried) {
+            tried = true;
+            auto candidate = std::make_unique<StatxRing>();
+            if (candidate->open(256)) ring = std::move(candidate);
+        }
+        if (ring && ring->dead()) ring.reset();
+        return ring.get();
+    }
+
+    // --uring version of the read_entry() loop. Names are admitted while the
+    // directory is read; then every stat load_entry() would make is sent to
+    // the ring in one go, with a second round for DT_UNKNOWN entries that
+    // turn out to be symlinks; then entries are admitted in readdir order.
+    // If the ring fails mid-way the directory falls back to load_entry(),
+    // and so does any entry whose statx failed for a reason other than
+    // ENOENT. Returns false, having read nothing, when there is no ring.
+    bool read_dir_batched(DIR* handle, DirListing& dir, WalkCounters& local) {
+        StatxRing* ring = uring();
+        if (!ring) return false;
+        int dir_fd = dirfd(handle);
+
+        std::vector<Entry> pending;
+        std::vector<unsigned char> types; // d_type as read, for the fallback
+        while (struct dirent* de = readdir(handle)) {
+            const char* name = de->d_name;
+            GlobSet::Match match;
+            if (!admit_name(dir, name, std::strlen(name), de->d_type, match, local.sys_stats)) continue;
+            pending.emplace_back();
+            Entry& entry = pending.back();
+            entry.name = name;
+            entry.type = de->d_type;
+            entry.pattern_hit = match.include;
+            types.push_back(de->d_type);
+        }
+
+        {
+            ScopedPhase phase(local.sys_stats.clock, Phase::Metadata);
+            std::vector<struct statx> results(pending.size());
+            std::vector<StatxRing::Request> requests;
+            std::vector<size_t> owners;
+            requests.reserve(pending.size());
+            owners.reserve(pending.size());
+            for (size_t i = 0; i < pending.size(); ++i) {
+                Entry& entry = pending[i];
+                int flags = AT_SYMLINK_NOFOLLOW;
+                if (entry.type == DT_LNK) {
+                    flags = 0;
+                } else if (entry.type == DT_DIR && !stats_dirs()) {
+                    entry.is_dir = true;
+                    continue;
+                }
+                requests.push_back({dir_fd, entry.name.c_str(), flags, &results[i], 0});
+                owners.push_back(i);
+            }
+
+            // Starts entry `i` over the way read_entry() would.
+            auto reload = [&](size_t i) {
+                Entry fresh;
+                fresh.name = std::move(pending[i].name);
+                fresh.type = types[i];
+                fresh.pattern_hit = pending[i].pattern_hit;
+                load_entry(dir_fd, fresh, local.sys_stats);
+                pending[i] = std::move(fresh);
+            };
+
+            local.sys_stats.stat_calls += requests.size();
+            bool ok = ring->run(requests.data(), requests.size());
+            std::vector<StatxRing::Request> follow;
+            std::vector<size_t> follow_owners;
+            std::vector<size_t> retry;
+            for (size_t k = 0; ok && k < requests.size(); ++k) {
+                Entry& entry = pending[owners[k]];
+                const struct statx& stx = results[owners[k]];
+                bool found = requests[k].error == 0;
+                if (!found && requests[k].error != ENOENT) {
+                    retry.push_back(owners[k]);
+                    continue;
+                }
+                if (entry.type == DT_UNKNOWN) {
+                    if (!found) continue;
+                    if (S_ISLNK(stx.stx_mode)) {
+                        entry.type = DT_LNK;
+                        entry.is_symlink = true;
+                        follow.push_back({dir_fd, entry.name.c_str(), 0, &results[owners[k]], 0});
+                        follow_owners.push_back(owners[k]);
+                        continue;
+                    }
+                    entry.type = S_ISDIR(stx.stx_mode) ? DT_DIR : DT_REG;
+                } else if (entry.type == DT_LNK) {
+                    entry.is_symlink = true;
+                } else if (entry.type == DT_DIR) {
+                    entry.is_dir = true;
+                }
+                if (found) fill_from_statx(entry, stx);
+            }
+
+            local.sys_stats.stat_calls += follow.size();
+            ok = ok && ring->run(follow.data(), follow.size());
+            for (size_t k = 0; ok && k < follow.size(); ++k) {
+                size_t i = follow_owners[k];
+                if (follow[k].error == 0) {
+                    fill_from_statx(pending[i], results[i]);
+                } else if (follow[k].error != ENOENT) {
+                    retry.push_back(i);
+                }
+            }
+
+            if (!ok) {
+                for (size_t i = 0; i < pending.size(); ++i) reload(i);
+            } else {
+                for (size_t i : retry) reload(i);
+            }
+        }
+
+        for (Entry& entry : pending) {
+            if (!admit_entry(entry, dir)) continue;
+            if (entry.is_symlink) read_link(dir_fd, entry, local.sys_stats);
+            if (counts_while_reading()) count_entry(entry, local.stats);
+            dir.entries.push_back(std::move(entry));
+        }
+        return true;
+    }
+#endif
+
+    void read_link(int dir_fd, Entry& entry, SyscallStats& sys_stats) {
+        ScopedPhase phase(sys_stats.clock, Phase::Metadata);
+        char target[PATH_MAX];
+        sys_stats.readlink_calls++;
+        ssize_t len = readlinkat(dir_fd, entry.name.c_str(), target, sizeof(target));
+        if (len >= 0) entry.target.assign(target, static_cast<size_t>(len));
+    }
+
+    // Packs an entry into the node record shared by --save and --cache,
+    // appending its name and link target to `strings`.
+    static SnapshotNode to_node(const Entry& entry, std::string& strings) {
+        SnapshotNode node{};
+        node.name_offset = static_cast<uint32_t>(strings.size());
+        node.name_len = static_cast<uint32_t>(entry.name.size());
+        strings += entry.name;
+        node.target_offset = static_cast<uint32_t>(strings.size());
+        node.target_len = static_cast<uint32_t>(entry.target.size());
+        strings += entry.target;
+        node.type = entry.type;
+        if (entry.is_dir) node.flags |= SNAP_IS_DIR;
+        if (entry.is_symlink) node.flags |= SNAP_IS_SYMLINK;
+        if (entry.has_stat) {
+            node.flags |= SNAP_HAS_STAT;
+            node.size = entry.size;
+            node.blocks = entry.blocks;
+            node.nlink = static_cast<uint32_t>(std::min<uint64_t>(entry.nlink, UINT32_MAX));
+            node.mode = static_cast<uint32_t>(entry.mode);
+            node.mtime = entry.mtime;
+            node.inode = entry.inode;
+            node.dev = entry.dev;
+        }
+        return node;
+    }
+
+    // The reverse of to_node() for everything but the strings.
+    static void from_node(const SnapshotNode& node, Entry& entry) {
+        entry.type = node.type;
+        entry.is_dir = node.flags & SNAP_IS_DIR;
+        entry.is_symlink = node.flags & SNAP_IS_SYMLINK;
+        if (node.flags & SNAP_HAS_STAT) {
+            entry.has_stat = true;
+            entry.mode = node.mode;
+            entry.size = node.size;
+            entry.blocks = node.blocks;
+            entry.nlink = node.nlink;
+            entry.mtime = node.mtime;
+            entry.inode = node.inode;
+            entry.dev = node.dev;
+        }
+    }
+
+    // The --fromfile counterpart of the readdir loop: same filters, but the
+    // names and metadata come from the mapped snapshot.
+    void read_snapshot_dir(DirListing& dir, WalkCounters& local) {
+        const SnapshotNode& node = snapshot->node(dir.snapshot_node);
+        if ((node.flags & SNAP_UNREADABLE) || !snapshot->has_children(node)) return;
+
+        for (uint32_t i = 0; i < node.child_count; ++i) {
+            uint32_t index = node.first_child + i;
+            const SnapshotNode& child = snapshot->node(index);
+            std::string_view name = snapshot->name(child);
+            if (name.empty()) continue;
+
+            GlobSet::Match match;
+            if (!admit_name(dir, name.data(), name.size(), child.type, match, local.sys_stats)) continue;
+
+            Entry entry;
+            entry.name.assign(name.data(), name.size());
+            entry.pattern_hit = match.include;
+            entry.snapshot_node = index;
+            from_node(child, entry);
+
+            if (!admit_entry(entry, dir)) continue;
+
+            std::string_view target = snapshot->target(child);
+            entry.target.assign(target.data(), target.size());
+
+            if (counts_while_reading()) count_entry(entry, local.stats);
+            dir.entries.push_back(std::move(entry));
+        }
+    }
+
+    // The --cache counterpart of the readdir loop: a directory whose stamp
+    // matches its cached listing is filtered from the cache without being
+    // opened; any other is read in full and stored for the next run.
+    bool read_cached_dir(DirListing& dir, WalkCounters& local) {
+        std::string path = path_of(dir);
+        struct stat st;
+        if (stat_at(AT_FDCWD, path.c_str(), &st, 0, local.sys_stats) != 0) return false;
+        CacheStamp stamp = ScanCache::stamp_of(st);
+        if (opts.gitignore) load_ignore_rules(dir, AT_FDCWD);
+        // On a hit the recorded metadata is trusted along with the names:
+        // the directory is neither read nor its entries stat'ed. A file
+        // rewritten or chmod'ed in place leaves its directory's stamp alone,
+        // so it keeps its recorded size and mode until the directory changes.
+        std::shared_ptr<const CachedListing> listing = cache->lookup(stamp);
+        if (!listing) listing = scan_for_cache(path, stamp, local);
+        if (!listing) return false;
+
+        for (const SnapshotNode& node : listing->nodes) {
+            std::string_view name = listing->string(node.name_offset, node.name_len);
+            if (name.empty()) continue;
+
+            GlobSet::Match match;
+            if (!admit_name(dir, name.data(), name.size(), node.type, match, local.sys_stats)) continue;
+
+            Entry entry;
+            entry.name.assign(name.data(), name.size());
+            entry.pattern_hit = match.include;
+            from_node(node, entry);
+
+            if (!admit_entry(entry, dir)) continue;
+
+            std::string_view target = listing->string(node.target_offset, node.target_len);
+            entry.target.assign(target.data(), target.size());
+
+            if (counts_while_reading()) count_entry(entry, local.stats);
+            dir.entries.push_back(std::move(entry));
+        }
+        return true;
+    }
+
+    std::shared_ptr<const CachedListing> scan_for_cache(const std::string& path,
+                                                        const CacheStamp& stamp,
+                                                        WalkCounters& local) {
+        DIR* handle = opendir(path.c_str());
+        if (!handle) return nullptr;
+        local.sys_stats.dirs_opened++;
+        int dir_fd = dirfd(handle);
+
+        auto listing = std::make_shared<CachedListing>();
+        listing->stamp = stamp;
+        while (struct dirent* de = readdir(handle)) {
+            const char* name = de->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+
+            Entry entry;
+            entry.name = name;
+            entry.type = de->d_type;
+            load_entry(dir_fd, entry, local.sys_stats, true);
+            if (entry.is_symlink) read_link(dir_fd, entry, local.sys_stats);
+            listing->nodes.push_back(to_node(entry, listing->strings));
+        }
+        closedir(handle);
+
+        cache->store(listing);
+        return listing;
+    }
+
+    // Sort key for one entry: the --dirsfirst group, then the -t/--sort rank
+    // taken from metadata already loaded, then the first eight name bytes
+    // packed big-endian, so most comparisons are integer compares and only
+    // ties fall back to the full name. Entries are moved once, after the keys
+    // are sorted.
+    struct SortKey {
+        uint64_t rank;
+        uint64_t prefix;
+        uint32_t index;
+        uint32_t group;
+    };
+
+    static uint64_t name_prefix(const std::string& name) {
+        uint64_t key = 0;
+        size_t n = std::min<size_t>(name.size(), 8);
+        for (size_t i = 0; i < n; ++i) {
+            key |= static_cast<uint64_t>(static_cast<unsigned char>(name[i])) << (56 - 8 * i);
+        }
+        return key;
+    }
+
+    // Ascending rank is display order: largest or newest first.
+    uint64_t sort_rank(const Entry& entry) const {
+        switch (opts.sort) {
+        case SortOrder::Size:
+            return ~static_cast<uint64_t>(entry.size);
+        case SortOrder::Mtime:
+            return ~(static_cast<uint64_t>(entry.mtime) ^ (1ULL << 63));
+        default:
+            return 0;
+        }
+    }
+
+    // Whether entries need sorting when they already come in name order.
+    bool reorders() const {
+        return opts.sort != SortOrder::Name || opts.dirs_first || (opts.top && !post_order());
+    }
+
+    // Sorts `entries` into display order. With a `limit`, only the first
+    // `limit` entries are kept: they are picked with nth_element before
+    // sorting, so a huge directory costs O(n + limit log limit).
+    void sort_entries(std::vector<Entry>& entries, PhaseClock& clock, size_t limit = 0) {
+        if (entries.size() < 2) return;
+        ScopedPhase phase(clock, Phase::Sort);
+
+        std::vector<SortKey> keys(entries.size());
+        for (size_t i = 0; i < entries.size(); ++i) {
+            const Entry& entry = entries[i];
+            uint32_t group = opts.dirs_first && !entry.is_dir;
+            keys[i] = {sort_rank(entry), name_prefix(entry.name), static_cast<uint32_t>(i), group};
+        }
+        auto before = [&](const SortKey& a, const SortKey& b) {
+            if (a.group != b.group) return a.group < b.group;
+            if (a.rank != b.rank) return a.rank < b.rank;
+            if (a.prefix != b.prefix) return a.prefix < b.prefix;
+            return entries[a.index].name < entries[b.index].name;
+        };
+        if (limit && keys.size() > limit) {
+            std::nth_element(keys.begin(), keys.begin() + limit, keys.end(), before);
+            keys.resize(limit);
+        }
+        std::sort(keys.begin(), keys.end(), before);
+
+        std::vector<Entry> sorted;
+        sorted.reserve(entries.size());
+        for (const auto& key : keys) sorted.push_back(std::move(entries[key.index]));
+        entries.swap(sorted);
+    }
+
+    // Reads, filters, counts and sorts one directory. Safe to call from
+    // any thread as long as each thread passes its own counters and
+    // PathIds. When directories are pruned, counting is left to the
+    // printer, and reading continues below -D so that directories at the
+    // limit can be pruned too.
+    void scan_dir(DirListing& dir, WalkCounters& local, PathIds& path) {
+        ScopedPhase phase(local.sys_stats.clock, Phase::Read);
+        if (dir.depth > opts.max_depth && !reads_below_depth()) {
+            dir.ok = true;
+            return;
+        }
+
+        // Under -P/-S and --du, --top applies to what survives pruning.
+        size_t limit = post_order() ? 0 : opts.top;
+        DIR* handle = nullptr;
+        if (snapshot) {
+            const SnapshotNode& node = snapshot->node(dir.snapshot_node);
+            if (node.flags & SNAP_UNREADABLE) return;
+            // Snapshot children are stored already sorted by name.
+            read_snapshot_dir(dir, local);
+            if (reorders()) sort_entries(dir.entries, local.sys_stats.clock, limit);
+        } else if (cache) {
+            if (!read_cached_dir(dir, local)) return;
+            if (!opts.unsorted) sort_entries(dir.entries, local.sys_stats.clock, limit);
+        } else {
+            int fd = dir_fds.open(dir, local.sys_stats);
+            handle = fd < 0 ? nullptr : fdopendir(fd);
+            if (!handle) {
+                if (fd >= 0) close(fd);
+                return;
+            }
+            local.sys_stats.dirs_opened++;
+            if (opts.gitignore) load_ignore_rules(dir, fd);
+
+#ifdef TREE_HAVE_URING
+            bool batched = opts.uring && read_dir_batched(handle, dir, local);
+#else
+            bool batched = false;
+#endif
+            Entry entry;
+            while (!batched && read_entry(handle, entry, dir, local)) {
+                if (counts_while_reading()) count_entry(entry, local.stats);
+                dir.entries.push_back(std::move(entry));
+            }
+
+            if (!opts.unsorted) sort_entries(dir.entries, local.sys_stats.clock, limit);
+        }
+        if (limit) {
+            for (const auto& entry : dir.entries) count_entry(entry, local.stats);
+        }
+
+        dir.subdirs.resize(dir.entries.size());
+        size_t subdirs = 0;
+        if (dir.depth < opts.max_depth || reads_below_depth()) {
+            for (size_t i = 0; i < dir.entries.size(); ++i) {
+                if (!dir.entries[i].is_dir || !should_descend(dir, dir.entries[i], path)) continue;
+                dir.subdirs[i] = std::make_unique<DirListing>();
+                init_subdir(*dir.subdirs[i], dir, dir.entries[i]);
+                subdirs++;
+            }
+        }
+        if (handle) {
+            // The subdirectories are opened relative to this directory.
+            int fd = subdirs ? dup(dirfd(handle)) : -1;
+            if (fd >= 0) dir_fds.keep(dir, fd, subdirs);
+            closedir(handle);
+        }
+        dir.ok = true;
+    }
+
+    // True when (dev, ino) is `dir` or one of its ancestors. `path` is the
+    // calling reader's own.
+    static bool on_path(const DirListing& dir, uint64_t dev, uint64_t inode, PathIds& path) {
+        path.move_to(dir);
+        return path.contains(dev, inode);
+    }
+
+    // Whether to descend into `entry`, a directory inside `dir`. Symlinks are
+    // only followed under -L, and never back onto the current path; -x stops
+    // at mount points.
+    bool should_descend(const DirListing& dir, Entry& entry, PathIds& path) {
+        if (entry.is_symlink && !opts.follow_symlinks) return false;
+        if (!entry.has_stat) return true;
+        if (opts.one_filesystem && entry.dev != root_dev) return false;
+        if (opts.follow_symlinks && on_path(dir, entry.dev, entry.inode, path)) {
+            entry.recursive = true;
+            return false;
+        }
+        return true;
+    }
+
+    void init_subdir(DirListing& sub, DirListing& dir, const Entry& entry) {
+        sub.name = entry.name;
+        sub.depth = dir.depth + 1;
+        sub.snapshot_node = entry.snapshot_node;
+        sub.parent = &dir;
+        if (needs_dir_ids() && entry.has_stat) {
+            sub.has_id = true;
+            sub.dev = entry.dev;
+            sub.inode = entry.inode;
+        }
+        if (opts.du && !entry.is_symlink) {
+            sub.du_apparent = entry.size;
+            sub.du_allocated = entry.blocks * 512;
+        }
+    }
+
+    // Records the root's identity for -L and -x before any reader starts.
+    void identify_root(DirListing& root) {
+        if (!needs_dir_ids()) return;
+        if (snapshot) {
+            const SnapshotNode& node = snapshot->node(0);
+            if (!(node.flags & SNAP_HAS_STAT)) return;
+            root.dev = node.dev;
+            root.inode = node.inode;
+        } else {
+            struct stat st;
+            if (stat_at(AT_FDCWD, root.name.c_str(), &st, 0, counters.sys_stats) != 0) return;
+            root.dev = static_cast<uint64_t>(st.st_dev);
+            root.inode = static_cast<uint64_t>(st.st_ino);
+        }
+        root.has_id = true;
+        root_dev = root.dev;
+    }
+
+    // Hands one entry of `dir` to the visitor.
+    void emit(const Entry& entry, int depth, bool is_last, const DirListing* subtree) {
+        EntryRecord record;
+        record.depth = depth;
+        record.name = entry.name;
+        record.target = entry.target;
+        record.type = entry.type;
+        record.is_dir = entry.is_dir;
+        record.is_symlink = entry.is_symlink;
+        record.is_last = is_last;
+        record.has_stat = entry.has_stat;
+        record.recursive = entry.recursive;
+        record.size = entry.size;
+        record.blocks = entry.blocks;
+        record.mode = static_cast<uint32_t>(entry.mode);
+        record.mtime = entry.mtime;
+        record.dev = entry.dev;
+        record.inode = entry.inode;
+        record.du_apparent = subtree ? subtree->du_apparent : 0;
+        record.du_allocated = subtree ? subtree->du_allocated : 0;
+        if (!entry.is_dir && !entry.is_symlink) {
+            record.du_apparent = entry.size;
+            record.du_allocated = entry.blocks * 512;
+        }
+        deliver(record);
+    }
+
+    // The same for node `node` of a resolved subtree.
+    void emit(const NodeStore& store, uint32_t node, int depth) {
+        uint8_t flags = store.node_flags(node);
+        EntryRecord record;
+        record.depth = depth;
+        record.name = store.name(node);
+        record.target = store.target(node);
+        record.type = store.node_type(node);
+        record.is_dir = (flags & NodeStore::IS_DIR) != 0;
+        record.is_symlink = (flags & NodeStore::IS_SYMLINK) != 0;
+        record.is_last = (flags & NodeStore::LAST) != 0;
+        record.has_stat = (flags & NodeStore::HAS_STAT) != 0;
+        record.recursive = (flags & NodeStore::RECURSIVE) != 0;
+        record.size = store.node_size(node);
+        record.blocks = store.node_blocks(node);
+        record.mode = store.node_mode(node);
+        record.mtime = store.node_mtime(node);
+        record.dev = store.node_dev(node);
+        record.inode = store.node_inode(node);
+        record.du_apparent = store.node_du_apparent(node);
+        record.du_allocated = store.node_du_allocated(node);
+        if (!record.is_dir && !record.is_symlink) {
+            record.du_apparent = record.size;
+            record.du_allocated = record.blocks * 512;
+        }
+        deliver(record);
+    }
+
+    void deliver(const EntryRecord& record) {
+        // The built-in renderer is called directly rather than through visit().
+        if (visitor == this) {
+            (this->*renderer)(record);
+        } else {
+            visitor->visit(record);
+        }
+    }
+
+    // The built-in visitor: emits one line straight into the output buffer,
+    // the prefix of ancestor glyphs, the connector, then the colored name and
+    // decorations. prefix_levels[d] is the prefix length for depth d + 1, so
+    // each line only trims the prefix and appends its own level. F is the
+    // render_features() of the options; everything they leave out is
+    // compiled away.
+    template <unsigned F>
+    void render_entry(const EntryRecord& entry) {
+        constexpr bool color = (F & RENDER_COLOR) != 0;
+        constexpr bool sizes = (F & RENDER_SIZE) != 0;
+        constexpr bool du = (F & RENDER_DU) != 0;
+        constexpr const TreeGlyphs& glyph = GLYPHS[(F & RENDER_ASCII) != 0];
+
+        ScopedPhase phase(counters.sys_stats.clock, Phase::Format);
+        bool size_error = false;
+        if constexpr (sizes || du) {
+            size_error = !entry.is_dir && !entry.has_stat && !(du && entry.is_symlink);
+        }
+
+        prefix.resize(prefix_levels[entry.depth - 1]);
+        out.write(prefix);
+        out.write(entry.is_last ? glyph.corner : glyph.junction);
+        if constexpr (color) {
+            if (size_error) {
+                out.write(COLOR_ERROR);
+            } else if (entry.is_symlink) {
+                out.write(COLOR_SYMLINK);
+            } else if (entry.is_dir) {
+                out.write(COLOR_DIR);
+            } else if (entry.has_stat && (entry.mode & S_IXUSR)) {
+                out.write(COLOR_EXEC);
+            } else {
+                out.write(COLOR_FILE);
+            }
+        }
+
+        if (size_error) {
+            out.write("[error accessing ", 17);
+            out.write(entry.name);
+            out.write("]", 1);
+        } else {
+            if constexpr (du) {
+                char size[32];
+                size_t len = format_size(entry.du_apparent, size, sizeof(size));
+                size[len++] = ' ';
+                out.write(size, len);
+                len = format_size(entry.du_allocated, size, sizeof(size));
+                size[len++] = ' ';
+                out.write(size, len);
+            } else if constexpr (sizes) {
+                if (!entry.is_dir) {
+                    char size[32];
+                    size_t len = format_size(entry.size, size, sizeof(size));
+                    size[len++] = ' ';
+                    out.write(size, len);
+                }
+            }
+            if constexpr ((F & RENDER_PERMS) != 0) {
+                char perms[10];
+                format_permissions(entry.has_stat, entry.mode, perms);
+                perms[9] = ' ';
+                out.write(perms, sizeof(perms));
+            }
+            out.write(entry.name);
+        }
+
+        if constexpr (color) out.write(COLOR_RESET);
+        if (entry.is_symlink) {
+            out.write(" -> ", 4);
+            out.write(entry.target);
+        }
+        if (entry.recursive) out.write("  [recursive, not followed]");
+        if constexpr ((F & RENDER_DUPES) != 0) {
+            if (uint32_t group = dupe_group(entry)) {
+                out.write("  [duplicate #");
+                out.write_number(group);
+                out.write("]", 1);
+            }
+        }
+        out.end_line();
+
+        prefix += entry.is_last ? glyph.blank : glyph.vertical;
+        prefix_levels.resize(entry.depth);
+        prefix_levels.push_back(prefix.size());
+    }
+
+    static const char* json_type(const EntryRecord& entry) {
+        switch (entry.type) {
+            case DT_DIR: return "directory";
+            case DT_LNK: return "link";
+            case DT_REG: return "file";
+            case DT_FIFO: return "fifo";
+            case DT_SOCK: return "socket";
+            case DT_CHR: return "char";
+            case DT_BLK: return "block";
+        }
+        return entry.is_dir ? "directory" : "file";
+    }
+
+    // The fields after the name or path, up to but not including the
+    // closing brace.
+    void write_json_fields(const EntryRecord& entry) {
+        out.write(",\"type\":\"");
+        out.write(json_type(entry));
+        out.write("\"", 1);
+        if (entry.is_symlink) {
+            // The link's own lstat() values cost no call: its size is the
+            // length of its target and, on Linux, its mode is always 0777.
+            // What it points to follows when that could be stat'ed.
+            write_json_stat("", entry.target.size(), 0777);
+            out.write(",\"target\":");
+            write_json_string(out, entry.target);
+            if (entry.has_stat) write_json_stat("target_", entry.size, entry.mode);
+        } else if (entry.has_stat) {
+            write_json_stat("", entry.size, entry.mode);
+        }
+        if (entry.recursive) out.write(",\"recursive\":true");
+        if (dupes) {
+            if (uint32_t group = dupe_group(entry)) {
+                out.write(",\"duplicate\":");
+                out.write_number(group);
+            }
+        }
+    }
+
+    // ,"<prefix>size":n,"<prefix>mode":"0755"
+    void write_json_stat(const char* prefix, uint64_t size, uint32_t mode) {
+        out.write(",\"", 2);
+        out.write(prefix);
+        out.write("size\":");
+        out.write_number(size);
+        char octal[] = "\":\"0000\"";
+        for (int i = 0; i < 4; ++i) {
+            octal[6 - i] = static_cast<char>('0' + ((mode >> (3 * i)) & 7));
+        }
+        out.write(",\"", 2);
+        out.write(prefix);
+        out.write("mode");
+        out.write(octal, sizeof(octal) - 1);
+    }
+
+    // --dupes: the group of identical files `entry` is in, or 0.
+    uint32_t dupe_group(const EntryRecord& entry) const {
+        if (!entry.has_stat || entry.is_symlink || !S_ISREG(entry.mode)) return 0;
+        return dupes->group_of(entry.dev, entry.inode);
+    }
+
+    // --ndjson: one self-contained object per line. The path is kept like
+    // the tree prefix, trimmed to the parent's length and extended by the
+    // name, so no line costs an allocation once the deepest path was seen.
+    void render_ndjson(const EntryRecord& entry) {
+        ScopedPhase phase(counters.sys_stats.clock, Phase::Format);
+        prefix.resize(prefix_levels[entry.depth - 1]);
+        if (prefix.empty() || prefix.back() != '/') prefix += '/';
+        prefix.append(entry.name.data(), entry.name.size());
+        prefix_levels.resize(entry.depth);
+        prefix_levels.push_back(prefix.size());
+
+        out.write("{\"depth\":");
+        out.write_number(static_cast<uintmax_t>(entry.depth));
+        out.write(",\"path\":");
+        write_json_string(out, prefix);
+        write_json_fields(entry);
+        out.write("}", 1);
+        out.end_line();
+    }
+
+    // -J: entries nest in their directory's "contents". An object stays open
+    // until the next entry shows whether it gets contents of its own, and
+    // closing it also closes every directory the walk has left since.
+    void render_json(const EntryRecord& entry) {
+        ScopedPhase phase(counters.sys_stats.clock, Phase::Format);
+        if (entry.depth > json_depth) {
+            if (json_depth > 0) out.write(",\"contents\":[");
+        } else {
+            out.write("}", 1);
+            for (int d = json_depth; d > entry.depth; --d) out.write("]}");
+            out.write(",", 1);
+        }
+        out.end_line();
+        json_depth = entry.depth;
+
+        out.write("{\"name\":");
+        write_json_string(out, entry.name);
+        write_json_fields(entry);
+    }
+
+    void begin_json() {
+        if (opts.format == OutputFormat::Ndjson) {
+            prefix.assign(opts.target_dir);
+            prefix_levels.assign(1, prefix.size());
+            out.write("{\"depth\":0,\"path\":");
+            write_json_string(out, opts.target_dir);
+            write_json_root_fields();
+            out.write("}", 1);
+            out.end_line();
+            return;
+        }
+        json_depth = 0;
+        out.write("[{\"name\":");
+        write_json_string(out, opts.target_dir);
+        write_json_root_fields();
+        out.write(",\"contents\":[");
+    }
+
+    // The root is followed if it is a link, so it is always a directory.
+    void write_json_root_fields() {
+        out.write(",\"type\":\"directory\"");
+        if (snapshot) {
+            const SnapshotNode& node = snapshot->node(0);
+            if (node.flags & SNAP_HAS_STAT) write_json_stat("", node.size, node.mode);
+            return;
+        }
+        struct stat st;
+        if (stat_at(AT_FDCWD, opts.target_dir.c_str(), &st, 0, counters.sys_stats) == 0) {
+            write_json_stat("", static_cast<uint64_t>(st.st_size), st.st_mode);
+        }
+    }
+
+    // Closes what render_json() left open and adds the summary as a
+    // "report" object, as tree -J does.
+    void end_json() {
+        if (opts.format == OutputFormat::Ndjson) return;
+        if (json_depth > 0) {
+            out.write("}", 1);
+            for (int d = json_depth; d > 1; --d) out.write("]}");
+        }
+        out.write("]},");
+        out.end_line();
+        const FileStats& stats = counters.stats;
+        out.write("{\"type\":\"report\",\"directories\":");
+        out.write_number(stats.directories);
+        out.write(",\"files\":");
+        out.write_number(stats.files);
+        out.write(",\"symlinks\":");
+        out.write_number(stats.symlinks);
+        out.write(",\"executables\":");
+        out.write_number(stats.executables);
+        if (opts.show_size || opts.size_filter) {
+            out.write(",\"size\":");
+            out.write_number(stats.total_size);
+        }
+        if (dupes) {
+            out.write(",\"duplicate_groups\":");
+            out.write_number(dupes->groups());
+            out.write(",\"duplicate_files\":");
+            out.write_number(dupes->files_in_groups());
+            out.write(",\"reclaimable\":");
+            out.write_number(dupes->reclaimable());
+        }
+        out.write("}]");
+        out.end_line();
+    }
+
+    static unsigned render_features(const Options& options) {
+        return (options.no_color ? 0u : RENDER_COLOR) |
+               (options.use_ascii ? RENDER_ASCII : 0u) |
+               (options.show_size || options.size_filter ? RENDER_SIZE : 0u) |
+               (options.show_perms ? RENDER_PERMS : 0u) |
+               (options.du ? RENDER_DU : 0u) |
+               (options.dupes ? RENDER_DUPES : 0u);
+    }
+
+    template <unsigned... F>
+    static auto select_renderer(unsigned features, std::integer_sequence<unsigned, F...>) {
+        static constexpr void (TreePrinter::*table[])(const EntryRecord&) = {
+            &TreePrinter::render_entry<F>...};
+        return table[features];
+    }
+
+    static void (TreePrinter::*renderer_for(const Options& options))(const EntryRecord&) {
+        switch (options.format) {
+            case OutputFormat::Json: return &TreePrinter::render_json;
+            case OutputFormat::Ndjson: return &TreePrinter::render_ndjson;
+            case OutputFormat::Tree: break;
+        }
+        return select_renderer(render_features(options),
+                               std::make_integer_sequence<unsigned, RENDER_COMBINATIONS>());
+    }
+
+    void reset_prefix() {
+        prefix.clear();
+        prefix_levels.assign(1, 0);
+    }
+
+    // Work-stealing pool of directory readers used by -j. Each worker owns
+    // a deque: it takes its own work LIFO, so it runs depth-first roughly in
+    // the order the printer will need it, and idle workers steal the oldest,
+    // shallowest directories from the front of someone else's deque.
+    class WalkerPool {
+    public:
+        WalkerPool(TreePrinter& printer, size_t thread_count) : printer(printer) {
+            for (size_t i = 0; i < thread_count; ++i) {
+                workers.push_back(std::make_unique<Worker>());
+                workers.back()->counters.sys_stats.clock.enabled = printer.opts.profile;
+            }
+        }
+
+        ~WalkerPool() {
+            for (auto& worker : workers) {
+                if (worker->thread.joinable()) worker->thread.join();
+            }
+        }
+
+        void start(DirListing& root) {
+            workers[0]->queue.push_back(&root);
+            pending = 1;
+            queued = 1;
+            for (size_t i = 0; i < workers.size(); ++i) {
+                workers[i]->thread = std::thread([this, i] { run(i); });
+            }
+        }
+
+        // Blocks the printer until a worker has published `dir`.
+        void wait(DirListing& dir) {
+            if (dir.ready.load(std::memory_order_acquire)) return;
+            std::unique_lock<std::mutex> lock(state_lock);
+            printer_waiting = true;
+            ready_cv.wait(lock, [&] { return dir.ready.load(std::memory_order_acquire); });
+            printer_waiting = false;
+        }
+
+        // Joins the workers and folds their private counters into `total`.
+        void finish(WalkCounters& total) {
+            for (auto& worker : workers) {
+                if (worker->thread.joinable()) worker->thread.join();
+                total.merge(worker->counters);
+            }
+        }
+
+    private:
+        struct Worker {
+            std::mutex lock;
+            std::deque<DirListing*> queue;
+            WalkCounters counters;
+            PathIds path;
+            std::thread thread;
+        };
+
+        TreePrinter& printer;
+        std::vector<std::unique_ptr<Worker>> workers;
+
+        std::mutex state_lock;
+        std::condition_variable work_cv;  // idle workers
+        std::condition_variable ready_cv; // the printer
+        size_t pending = 0; // directories queued or being read
+        size_t queued = 0;  // directories sitting in some deque
+        size_t idle = 0;
+        bool printer_waiting = false;
+
+        DirListing* take(size_t id) {
+            DirListing* dir = nullptr;
+            {
+                Worker& own = *workers[id];
+                std::lock_guard<std::mutex> guard(own.lock);
+                if (!own.queue.empty()) {
+                    dir = own.queue.back();
+                    own.queue.pop_back();
+                }
+            }
+            for (size_t k = 1; !dir && k < workers.size(); ++k) {
+                Worker& victim = *workers[(id + k) % workers.size()];
+                std::lock_guard<std::mutex> guard(victim.lock);
+                if (!victim.queue.empty()) {
+                    dir = victim.queue.front();
+                    victim.queue.pop_front();
+                }
+            }
+            if (dir) {
+                std::lock_guard<std::mutex> guard(state_lock);
+                queued--;
+            }
+            return dir;
+        }
+
+        void run(size_t id) {
+            Worker& self = *workers[id];
+            for (;;) {
+                DirListing* dir = take(id);
+                if (!dir) {
+                    std::unique_lock<std::mutex> lock(state_lock);
+                    if (pending == 0) break;
+                    idle++;
+                    work_cv.wait(lock, [&] { return queued > 0 || pending == 0; });
+                    idle--;
+                    continue;
+                }
+
+                printer.scan_dir(*dir, self.counters, self.path);
+
+                // Push children last-first so the first child is taken next.
+                size_t pushed = 0;
+                {
+                    std::lock_guard<std::mutex> guard(self.lock);
+                    for (size_t i = dir->subdirs.size(); i-- > 0;) {
+                        if (dir->subdirs[i]) {
+                            self.queue.push_back(dir->subdirs[i].get());
+                            pushed++;
+                        }
+                    }
+                }
+
+                std::lock_guard<std::mutex> guard(state_lock);
+                pending += pushed;
+                queued += pushed;
+                pending--;
+                // After this store the printer may consume and free `dir`.
+                dir->ready.store(true, std::memory_order_release);
+                if (printer_waiting) ready_cv.notify_all();
+                if ((pushed > 0 && idle > 0) || pending == 0) work_cv.notify_all();
+            }
+        }
+    };
+
+    void fetch(DirListing& dir, WalkerPool* pool) {
+        if (pool) {
+            pool->wait(dir);
+        } else {
+            scan_dir(dir, counters, path_ids);
+        }
+    }
+
+    // Decides whether entry `i` of `dir` is shown, given whether anything
+    // survived in its subtree, and adds that subtree to the --du totals.
+    bool survives(DirListing& dir, size_t i, bool below) {
+        const Entry& entry = dir.entries[i];
+        if (!entry.is_dir) return true;
+
+        DirListing* sub = dir.subdirs[i].get();
+        if (sub && opts.du && !entry.is_symlink) {
+            dir.du_apparent += sub->du_apparent;
+            dir.du_allocated += sub->du_allocated;
+        }
+
+        if (!prunes_dirs()) return true;
+        return below || matches_filters(entry);
+    }
+
+    // The same, resolving the subtree first.
+    bool survives(DirListing& dir, size_t i, WalkerPool* pool) {
+        DirListing* sub = dir.subdirs[i].get();
+        bool below = sub && prune(*sub, pool);
+        return survives(dir, i, below);
+    }
+
+    // Charges each hard-linked file once across the whole walk. Runs on the
+    // printer thread in display order, so the result does not depend on -j.
+    void add_hardlinks(DirListing& dir) {
+        for (const auto& link : dir.hardlinks) {
+            if (du_seen.insert({link.dev, link.inode}).second) {
+                dir.du_apparent += link.apparent;
+                dir.du_allocated += link.allocated;
+            }
+        }
+        dir.hardlinks.clear();
+        dir.hardlinks.shrink_to_fit();
+    }
+
+    // Offers a finished directory to --du-top's bounded min-heap; the path
+    // is only copied when it makes the cut.
+    void offer_du_top(const DirListing& dir) {
+        if (du_heaviest.size() == opts.du_top) {
+            if (dir.du_allocated <= du_heaviest.top().allocated) return;
+            du_heaviest.pop();
+        }
+        du_heaviest.push({dir.du_allocated, dir.du_apparent, path_of(dir)});
+    }
+
+    // A directory being pruned, with the entry being decided.
+    struct PruneFrame {
+        DirListing* dir;
+        size_t next = 0;
+        size_t kept = 0;
+        bool any = false;
+        bool descended = false; // the subtree of entry `next` has answered
+    };
+
+    // Fetches `dir` and pushes it onto `stack`; false if it cannot be read.
+    bool begin_prune(DirListing& dir, WalkerPool* pool, std::vector<PruneFrame>& stack) {
+        fetch(dir, pool);
+        dir.resolved = true;
+        if (!dir.ok) return false;
+        if (opts.du) add_hardlinks(dir);
+        stack.push_back({&dir, 0, 0, dir.has_match, false});
+        return true;
+    }
+
+    bool end_prune(PruneFrame& frame, NodeStore* store) {
+        DirListing& dir = *frame.dir;
+        dir.entries.resize(frame.kept);
+        dir.subdirs.resize(frame.kept);
+        if (opts.du_top) offer_du_top(dir);
+
+        // --du-top prints no entries, and nothing below -D is printed.
+        if (dir.depth > opts.max_depth || !store) {
+            std::vector<Entry>().swap(dir.entries);
+            std::vector<std::unique_ptr<DirListing>>().swap(dir.subdirs);
+        }
+        if (store) compact(dir, *store);
+        return frame.any;
+    }
+
+    // Moves the entries of `dir`, now decided, into `store`. Their subtrees
+    // are there already, so the subdirectory listings are released.
+    void compact(DirListing& dir, NodeStore& store) {
+        uint32_t first = store.size();
+        for (size_t i = 0; i < dir.entries.size(); ++i) {
+            const Entry& entry = dir.entries[i];
+            uint8_t flags = 0;
+            if (entry.is_dir) flags |= NodeStore::IS_DIR;
+            if (entry.is_symlink) flags |= NodeStore::IS_SYMLINK;
+            if (entry.has_stat) flags |= NodeStore::HAS_STAT;
+            if (entry.recursive) flags |= NodeStore::RECURSIVE;
+            if (i + 1 == dir.entries.size()) flags |= NodeStore::LAST;
+            uint32_t node = store.add(entry.name, entry.target, entry.type, flags,
+                                      static_cast<uint32_t>(entry.mode), entry.size,
+                                      entry.blocks, entry.mtime, entry.dev, entry.inode);
+            if (dupes && entry.has_stat && !entry.is_symlink && S_ISREG(entry.mode)) {
+                dupes->add(node, entry.size, entry.dev, entry.inode);
+            }
+
+            const DirListing* sub = dir.subdirs[i].get();
+            if (!sub) continue;
+            store.set_du(node, sub->du_apparent, sub->du_allocated);
+            if (!sub->ok && sub->depth <= opts.max_depth) store.set_flag(node, NodeStore::UNREADABLE);
+            if (sub->first_node != NodeStore::NONE) {
+                store.set_first_child(node, sub->first_node);
+                store.adopt(node, sub->first_node, sub->last_node);
+            }
+        }
+        if (store.size() != first) {
+            dir.first_node = first;
+            dir.last_node = store.size() - 1;
+        }
+        dir.compacted = true;
+        std::vector<Entry>().swap(dir.entries);
+        std::vector<std::unique_ptr<DirListing>>().swap(dir.subdirs);
+    }
+
+    // Blocks are only shown through --du, but other visitors get them all.
+    bool keeps_blocks() const {
+        return opts.du || visitor != this;
+    }
+
+    // Identities are only read by --dupes, and likewise by other visitors.
+    bool keeps_ids() const {
+        return dupes || visitor != this;
+    }
+
+    // Post-order pass: reads the subtree under `root`, drops every directory
+    // that leads to no -P/-S match, totals --du sizes and reports whether
+    // anything in `root` survived. Each directory is decided once, from its
+    // children's answers, and then compacted into root's NodeStore.
+    // The descent uses an explicit stack, so depth costs no native stack.
+    bool prune(DirListing& root, WalkerPool* pool) {
+        ScopedPhase phase(counters.sys_stats.clock, Phase::Prune);
+        if (!opts.du_top) root.store = std::make_unique<NodeStore>(store_usage, keeps_blocks(), opts.du,
+                                                                keeps_ids());
+        std::vector<PruneFrame> stack;
+        bool answer = false; // of the subtree that finished last
+        begin_prune(root, pool, stack);
+
+        while (!stack.empty()) {
+            PruneFrame& frame = stack.back();
+            DirListing& dir = *frame.dir;
+            if (frame.next == dir.entries.size()) {
+                answer = end_prune(frame, root.store.get());
+                stack.pop_back();
+                continue;
+            }
+
+            size_t i = frame.next;
+            DirListing* sub = dir.subdirs[i].get();
+            if (sub && !frame.descended) {
+                frame.descended = true;
+                if (begin_prune(*sub, pool, stack)) continue;
+                answer = false;
+            }
+            frame.descended = false;
+            frame.next++;
+
+            if (!survives(dir, i, sub && answer)) continue;
+            frame.any = true;
+            if (opts.top && frame.kept == opts.top) continue;
+            if (frame.kept != i) {
+                dir.entries[frame.kept] = std::move(dir.entries[i]);
+                dir.subdirs[frame.kept] = std::move(dir.subdirs[i]);
+            }
+            frame.kept++;
+        }
+        return answer;
+    }
+
+    void report_unreadable(const std::string& path) {
+        out.flush();
+        std::cerr << "Error: Permission denied or other error accessing "
+                  << fs::path(path) << std::endl;
+    }
+
+    void report_unreadable(const DirListing& dir) { report_unreadable(path_of(dir)); }
+
+    // Path of `node` in the store of `owner`, from the parent indices.
+    static std::string path_of(const DirListing& owner, uint32_t node) {
+        const NodeStore& store = *owner.store;
+        std::vector<uint32_t> chain;
+        for (uint32_t n = node; n != NodeStore::NONE; n = store.parent(n)) chain.push_back(n);
+        std::string path = path_of(owner);
+        for (size_t k = chain.size(); k-- > 0;) append_path(path, store.name(chain[k]));
+        return path;
+    }
+
+    // print_tree() for a listing that prune() compacted: walks its store in
+    // display order with one slot per level, the next node to print there.
+    void print_nodes(const DirListing& dir) {
+        const NodeStore& store = *dir.store;
+        Entry entry; // the fields count_entry() reads
+        std::vector<uint32_t> stack;
+        if (dir.first_node != NodeStore::NONE) stack.push_back(dir.first_node);
+        while (!stack.empty()) {
+            uint32_t node = stack.back();
+            if (node == NodeStore::NONE) {
+                stack.pop_back();
+                continue;
+            }
+            uint8_t flags = store.node_flags(node);
+            stack.back() = (flags & NodeStore::LAST) ? NodeStore::NONE : node + 1;
+
+            entry.is_dir = (flags & NodeStore::IS_DIR) != 0;
+            entry.is_symlink = (flags & NodeStore::IS_SYMLINK) != 0;
+            entry.has_stat = (flags & NodeStore::HAS_STAT) != 0;
+            entry.mode = store.node_mode(node);
+            entry.size = store.node_size(node);
+            count_entry(entry, counters.stats);
+            emit(store, node, dir.depth + static_cast<int>(stack.size()) - 1);
+
+            if (flags & NodeStore::UNREADABLE) {
+                report_unreadable(path_of(dir, node));
+            } else if (store.first_child(node) != NodeStore::NONE) {
+                stack.push_back(store.first_child(node));
+            }
+        }
+    }
+
+    void print_child(DirListing& dir, size_t i, bool is_last, WalkerPool* pool) {
+        if (post_order()) count_entry(dir.entries[i], counters.stats);
+        emit(dir.entries[i], dir.depth, is_last, dir.subdirs[i].get());
+
+        if (dir.subdirs[i] && dir.subdirs[i]->depth <= opts.max_depth) {
+            print_tree(*dir.subdirs[i], pool);
+        }
+        dir.subdirs[i].reset();
+    }
+
+    // Prints the subtree under `root`. Without a pool each directory is read
+    // on demand; with one, the printer only waits for listings the workers
+    // have already started on. Listings are freed as soon as they are
+    // printed, and the descent uses an explicit stack of (listing, next
+    // entry) pairs, so depth costs neither native stack nor more than one
+    // frame per level.
+    //
+    // Under -P/-S and --du a sibling of the root is printed as soon as the
+    // next surviving sibling has been resolved, so only the subtree
+    // currently being decided is held in memory; everything below the root
+    // has been resolved by then.
+    void print_tree(DirListing& root, WalkerPool* pool) {
+        if (root.depth > opts.max_depth) return;
+        if (!root.resolved) fetch(root, pool);
+
+        if (!root.ok) {
+            report_unreadable(root);
+            return;
+        }
+
+        if (post_order() && !root.resolved) {
+            print_resolving(root, pool);
+            return;
+        }
+        if (root.compacted) {
+            print_nodes(root);
+            return;
+        }
+
+        std::vector<std::pair<DirListing*, size_t>> stack;
+        stack.push_back({&root, 0});
+        while (!stack.empty()) {
+            DirListing& dir = *stack.back().first;
+            size_t i = stack.back().second++;
+            if (i == dir.entries.size()) {
+                stack.pop_back();
+                if (!stack.empty()) {
+                    auto& parent = stack.back();
+                    parent.first->subdirs[parent.second - 1].reset();
+                }
+                continue;
+            }
+
+            if (post_order()) count_entry(dir.entries[i], counters.stats);
+            emit(dir.entries[i], dir.depth, i == dir.entries.size() - 1, dir.subdirs[i].get());
+
+            DirListing* sub = dir.subdirs[i].get();
+            if (sub && sub->depth <= opts.max_depth) {
+                if (!sub->resolved) fetch(*sub, pool);
+                if (sub->ok) {
+                    stack.push_back({sub, 0});
+                    continue;
+                }
+                report_unreadable(*sub);
+            }
+            dir.subdirs[i].reset();
+        }
+    }
+
+    void print_resolving(DirListing& dir, WalkerPool* pool) {
+        dir.resolved = true;
+        if (opts.du) add_hardlinks(dir);
+        size_t pending = dir.entries.size();
+        size_t printed = 0;
+        for (size_t i = 0; i < dir.entries.size(); ++i) {
+            bool shown = survives(dir, i, pool);
+            // Past --top the rest are still resolved for their --du totals.
+            bool full = opts.top && pending != dir.entries.size() && printed + 1 == opts.top;
+            if (!shown || full) {
+                dir.subdirs[i].reset();
+                continue;
+            }
+            if (pending != dir.entries.size()) {
+                print_child(dir, pending, false, pool);
+                printed++;
+            }
+            pending = i;
+        }
+        if (pending != dir.entries.size()) print_child(dir, pending, true, pool);
+    }
+
+    // A directory being streamed under -U. Once more than --fd-budget
+    // directories are open, the shallowest is read to the end into `rest`
+    // and closed.
+    struct StreamFrame {
+        std::unique_ptr<DirListing> owned; // null for the root
+        DirListing* dir = nullptr;
+        DIR* handle = nullptr;
+        std::vector<Entry> rest;
+        size_t next_rest = 0;
+        Entry pending;
+        bool have_pending = false;
+    };
+
+    bool open_stream(StreamFrame& frame) {
+        DirListing& dir = *frame.dir;
+        int fd = dir_fds.open(dir, counters.sys_stats);
+        frame.handle = fd < 0 ? nullptr : fdopendir(fd);
+        if (!frame.handle) {
+            if (fd >= 0) close(fd);
+            report_unreadable(dir);
+            return false;
+        }
+        counters.sys_stats.dirs_opened++;
+        if (opts.gitignore) load_ignore_rules(dir, fd);
+        dir_fds.keep(dir, fd, DirFds::UNTIL_DROPPED, true);
+        frame.have_pending = read_entry(frame.handle, frame.pending, dir, counters);
+        return true;
+    }
+
+    bool stream_next(StreamFrame& frame, Entry& entry) {
+        if (frame.handle) return read_entry(frame.handle, entry, *frame.dir, counters);
+        if (frame.next_rest == frame.rest.size()) return false;
+        entry = std::move(frame.rest[frame.next_rest++]);
+        return true;
+    }
+
+    // Reads the rest of `frame` ahead and closes its stream. DirFds keeps a
+    // duplicate descriptor for the subdirectories still to come, which it
+    // may close and reopen like any other.
+    void drain_stream(StreamFrame& frame) {
+        Entry entry;
+        while (read_entry(frame.handle, entry, *frame.dir, counters)) {
+            frame.rest.push_back(std::move(entry));
+        }
+        int fd = dup(dirfd(frame.handle));
+        if (fd >= 0) {
+            dir_fds.keep(*frame.dir, fd, DirFds::UNTIL_DROPPED);
+        } else {
+            dir_fds.drop(*frame.dir);
+        }
+        closedir(frame.handle);
+        frame.handle = nullptr;
+    }
+
+    void close_stream(StreamFrame& frame) {
+        dir_fds.drop(*frame.dir);
+        if (frame.handle) closedir(frame.handle);
+        frame.handle = nullptr;
+    }
+
+    // --fd-budget, held to half the descriptor limit so that files and the
+    // -j readers still have room.
+    static size_t fd_budget(const Options& options) {
+        size_t budget = options.fd_budget;
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+            budget = std::min<size_t>(budget, limit.rlim_cur / 2);
+        }
+        return std::max<size_t>(budget, 2);
+    }
+
+    // Directories -U keeps open for reading, out of the budget; the rest is
+    // left to DirFds.
+    static size_t stream_budget(const Options& options) {
+        return std::max<size_t>(fd_budget(options) / 2, 1);
+    }
+
+    size_t stream_budget() const { return stream_budget(opts); }
+
+    // -U without pruning: entries are printed in readdir order as they come,
+    // holding one entry back per level only to know whether it is the last.
+    // Memory does not depend on directory size until more directories are
+    // open than the budget allows. Walked with an explicit stack.
+    void stream_tree(DirListing& root) {
+        if (root.depth > opts.max_depth) return;
+        ScopedPhase phase(counters.sys_stats.clock, Phase::Read);
+
+        std::vector<StreamFrame> stack;
+        size_t open_streams = 0;
+        size_t shallowest = 0; // frames below this one are drained
+        stack.emplace_back();
+        stack.back().dir = &root;
+        if (!open_stream(stack.back())) return;
+        open_streams++;
+
+        while (!stack.empty()) {
+            StreamFrame& frame = stack.back();
+            if (!frame.have_pending) {
+                if (frame.handle) open_streams--;
+                close_stream(frame);
+                stack.pop_back();
+                shallowest = std::min(shallowest, stack.size());
+                continue;
+            }
+
+            DirListing& dir = *frame.dir;
+            Entry entry = std::move(frame.pending);
+            frame.have_pending = stream_next(frame, frame.pending);
+            bool is_last = !frame.have_pending;
+            bool descend = entry.is_dir && dir.depth < opts.max_depth &&
+                           should_descend(dir, entry, path_ids);
+
+            count_entry(entry, counters.stats);
+            emit(entry, dir.depth, is_last, nullptr);
+            if (!descend) continue;
+
+            if (open_streams >= stream_budget()) {
+                while (!stack[shallowest].handle) shallowest++;
+                drain_stream(stack[shallowest]);
+                open_streams--;
+            }
+            StreamFrame child;
+            child.owned = std::make_unique<DirListing>();
+            child.dir = child.owned.get();
+            init_subdir(*child.dir, dir, entry);
+            stack.push_back(std::move(child));
+            if (open_stream(stack.back())) {
+                open_streams++;
+            } else {
+                stack.pop_back();
+            }
+        }
+    }
+
+    // Charges the root directory's own inode for --du.
+    void charge_root(DirListing& root) {
+        if (snapshot) {
+            const SnapshotNode& node = snapshot->node(0);
+            if (node.flags & SNAP_HAS_STAT) {
+                root.du_apparent = node.size;
+                root.du_allocated = node.blocks * 512;
+            }
+            return;
+        }
+        struct stat st;
+        if (stat_at(AT_FDCWD, root.name.c_str(), &st, 0, counters.sys_stats) == 0) {
+            root.du_apparent = static_cast<uint64_t>(st.st_size);
+            root.du_allocated = static_cast<uint64_t>(st.st_blocks) * 512;
+        }
+    }
+
+    // --du-top: resolves the whole tree without printing it, then lists the
+    // heaviest directories by allocated size, largest first.
+    void print_du_top(DirListing& root) {
+        if (opts.threads <= 1) {
+            prune(root, nullptr);
+        } else {
+            WalkerPool pool(*this, static_cast<size_t>(opts.threads));
+            pool.start(root);
+            prune(root, &pool);
+            pool.finish(counters);
+        }
+
+        std::vector<DuTop> heaviest;
+        while (!du_heaviest.empty()) {
+            heaviest.push_back(std::move(const_cast<DuTop&>(du_heaviest.top())));
+            du_heaviest.pop();
+        }
+        for (size_t i = heaviest.size(); i-- > 0;) {
+            char size[32];
+            size_t len = format_size(heaviest[i].apparent, size, sizeof(size));
+            size[len++] = ' ';
+            out.write(size, len);
+            len = format_size(heaviest[i].allocated, size, sizeof(size));
+            size[len++] = ' ';
+            out.write(size, len);
+            out.write(heaviest[i].path);
+            out.end_line();
+        }
+    }
+
+    void write_du_total(const DirListing& root) {
+        out.write("Disk usage: ");
+        out.write(format_size(root.du_apparent));
+        out.write(" apparent, ");
+        out.write(format_size(root.du_allocated));
+        out.write(" allocated");
+    }
+
+    void walk(DirListing& root) {
+        if (opts.unsorted && opts.threads <= 1 && !post_order() && !snapshot && !cache) {
+            stream_tree(root);
+            return;
+        }
+
+        if (opts.threads <= 1) {
+            resolve_dupes(root, nullptr);
+            print_tree(root, nullptr);
+            return;
+        }
+
+        WalkerPool pool(*this, static_cast<size_t>(opts.threads));
+        pool.start(root);
+        resolve_dupes(root, &pool);
+        print_tree(root, &pool);
+        pool.finish(counters);
+    }
+
+    // --dupes: the whole tree is resolved into the root's NodeStore, which
+    // hands every regular file it keeps to DupeFinder, and the files are
+    // compared before the first line is printed.
+    void resolve_dupes(DirListing& root, WalkerPool* pool) {
+        if (!dupes || root.depth > opts.max_depth) return;
+        prune(root, pool);
+        ScopedPhase phase(counters.sys_stats.clock, Phase::Hash);
+        size_t threads = opts.threads > 1 ? static_cast<size_t>(opts.threads)
+                                          : std::max(1u, std::thread::hardware_concurrency());
+        dupes->run(threads, [&](uint32_t node) { return path_of(root, node); });
+    }
+
+    // --count reads directories with getdents64 into one reusable buffer
+    // and classifies entries by d_type. Files are still stat'ed for the
+    // executables count, and links only when -d, -e or -s has to know what
+    // they point to; no entry vector or readlink is involved. Options whose
+    // counts depend on more than that take the ordinary walk instead, with
+    // nothing rendered.
+    bool counts_from_dirents() const {
+        return !post_order() && !needs_dir_ids() && !opts.gitignore && !opts.top &&
+               !snapshot && !cache;
+    }
+
+    // struct linux_dirent64, as getdents64 lays records out.
+    struct RawDirent {
+        uint64_t ino;
+        int64_t off;
+        unsigned short reclen;
+        unsigned char type;
+        char name[1];
+    };
+
+    static constexpr size_t DIRENT_BUFFER_SIZE = 1 << 20;
+
+    // Counts the subtree under `root` into counters.stats, depth-first with
+    // one listing per directory on the stack and no entries kept.
+    void count_tree(DirListing& root) {
+        if (root.depth > opts.max_depth) return;
+        std::unique_ptr<char[]> buffer(new char[DIRENT_BUFFER_SIZE]);
+        if (!count_dir(root, buffer.get())) return;
+
+        std::vector<std::pair<DirListing*, size_t>> stack;
+        stack.push_back({&root, 0});
+        while (!stack.empty()) {
+            DirListing& dir = *stack.back().first;
+            size_t i = stack.back().second++;
+            if (i == dir.subdirs.size()) {
+                stack.pop_back();
+                if (!stack.empty()) {
+                    auto& parent = stack.back();
+                    parent.first->subdirs[parent.second - 1].reset();
+                }
+                continue;
+            }
+            if (count_dir(*dir.subdirs[i], buffer.get())) {
+                stack.push_back({dir.subdirs[i].get(), 0});
+            } else {
+                dir.subdirs[i].reset();
+            }
+        }
+    }
+
+    // Counts the entries of `dir` and lists the subdirectories to descend
+    // into as its subdirs. False, after reporting it, if `dir` cannot be read.
+    bool count_dir(DirListing& dir, char* buffer) {
+        SyscallStats& sys_stats = counters.sys_stats;
+        ScopedPhase phase(sys_stats.clock, Phase::Read);
+        int fd = dir_fds.open(dir, sys_stats);
+        if (fd < 0) {
+            report_unreadable(dir);
+            return false;
+        }
+        sys_stats.dirs_opened++;
+
+        long len;
+        while ((len = syscall(SYS_getdents64, fd, buffer, DIRENT_BUFFER_SIZE)) > 0) {
+            for (long at = 0; at < len;) {
+                const RawDirent* de = reinterpret_cast<const RawDirent*>(buffer + at);
+                at += de->reclen;
+                count_dirent(dir, fd, de->name, de->type);
+            }
+        }
+
+        if (dir.subdirs.empty()) {
+            close(fd);
+        } else {
+            dir_fds.keep(dir, fd, dir.subdirs.size());
+        }
+        return true;
+    }
+
+    // admit_name(), load_entry() and is_visible() for --count, stat'ing only
+    // when d_type or the options leave no choice. The entry keeps no name
+    // unless it is a directory to descend into.
+    void count_dirent(DirListing& dir, int dir_fd, const char* name, unsigned char type) {
+        size_t len = std::strlen(name);
+        if (name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.'))) return;
+        if (!opts.show_all && name[0] == '.') return;
+        SyscallStats& sys_stats = counters.sys_stats;
+        sys_stats.entries++;
+        if (globs.match(name, len).exclude) return;
+        if (opts.dirs_only && type == DT_REG) return;
+
+        Entry entry;
+        entry.type = type;
+        struct stat st;
+        if (type == DT_UNKNOWN) {
+            ScopedPhase phase(sys_stats.clock, Phase::Metadata);
+            if (stat_at(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW, sys_stats) == 0) {
+                if (S_ISLNK(st.st_mode)) {
+                    type = DT_LNK;
+                } else {
+                    entry.type = type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+                    fill_from_stat(entry, st);
+                }
+            }
+        }
+
+        if (type == DT_LNK) {
+            entry.type = DT_LNK;
+            entry.is_symlink = true;
+            // Links are shown and counted as links whatever they point to,
+            // unless -d has to know whether that is a directory.
+            if (opts.dirs_only || opts.only_executables || opts.show_size) {
+                ScopedPhase phase(sys_stats.clock, Phase::Metadata);
+                if (stat_at(dir_fd, name, &st, 0, sys_stats) == 0) fill_from_stat(entry, st);
+            }
+        } else if (type == DT_DIR) {
+            entry.is_dir = true;
+        } else if (!entry.has_stat && !opts.only_symlinks && !opts.dirs_only) {
+            // The summary counts executables, which only the mode tells
+            // apart. Under -d or -l no file is shown, so none can be one.
+            ScopedPhase phase(sys_stats.clock, Phase::Metadata);
+            if (stat_at(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW, sys_stats) == 0) {
+                fill_from_stat(entry, st);
+            }
+        }
+
+        if (!is_visible(entry)) return;
+        count_entry(entry, counters.stats);
+        if (entry.is_dir && !entry.is_symlink && dir.depth < opts.max_depth) {
+            entry.name.assign(name, len);
+            dir.subdirs.push_back(std::make_unique<DirListing>());
+            init_subdir(*dir.subdirs.back(), dir, entry);
+        }
+    }
+
+    // --watch keeps every listing of the first walk as the model of the
+    // screen, with an inotify watch on each directory. A burst of events is
+    // coalesced into one batch; each changed directory is read again, its
+    // counts are patched in place and only the lines under it are rebuilt.
+    static constexpr uint32_t WATCH_EVENTS =
+        IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB |
+        IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+    void add_watch(DirListing& dir) {
+        if (!dir.ok) return;
+        std::string path = path_of(dir);
+        int wd = inotify_add_watch(inotify_fd, path.c_str(), WATCH_EVENTS);
+        if (wd < 0) {
+            static bool warned = false;
+            if (!warned) {
+                std::cerr << "Warning: cannot watch " << path << ": "
+                          << std::strerror(errno) << std::endl;
+                warned = true;
+            }
+            return;
+        }
+        dir.watch = wd;
+        watched[wd].push_back(&dir);
+    }
+
+    void remove_watch(DirListing& dir) {
+        if (dir.watch < 0) return;
+        auto it = watched.find(dir.watch);
+        if (it != watched.end()) {
+            auto& listings = it->second;
+            listings.erase(std::remove(listings.begin(), listings.end(), &dir), listings.end());
+            if (listings.empty()) {
+                inotify_rm_watch(inotify_fd, dir.watch);
+                watched.erase(it);
+            }
+        }
+        dir.watch = -1;
+    }
+
+    // The kernel dropped a watch, usually because its directory is gone.
+    void forget_watch(int wd) {
+        auto it = watched.find(wd);
+        if (it == watched.end()) return;
+        for (DirListing* dir : it->second) dir->watch = -1;
+        watched.erase(it);
+    }
+
+    // Reads `dir` and everything below it into the model and watches it.
+    void load_model(DirListing& dir, WalkerPool* pool) {
+        fetch(dir, pool);
+        add_watch(dir);
+        dir.lines = dir.entries.size();
+        for (auto& sub : dir.subdirs) {
+            if (!sub) continue;
+            load_model(*sub, pool);
+            dir.lines += sub->lines;
+        }
+    }
+
+    // Takes a subtree out of the model: its counts go into `gone` and its
+    // watches are released.
+    void drop_model(DirListing& dir, FileStats& gone) {
+        remove_watch(dir);
+        for (size_t i = 0; i < dir.entries.size(); ++i) {
+            count_entry(dir.entries[i], gone);
+            if (dir.subdirs[i]) drop_model(*dir.subdirs[i], gone);
+        }
+    }
+
+    // Reads one changed directory again. Subdirectories that are still there
+    // and still watched keep their listings; new ones are loaded, vanished
+    // ones dropped, and the counters and line totals adjusted by the difference.
+    void patch_model(DirListing& dir) {
+        std::vector<Entry> old_entries = std::move(dir.entries);
+        std::vector<std::unique_ptr<DirListing>> old_subdirs = std::move(dir.subdirs);
+        dir.entries.clear();
+        dir.subdirs.clear();
+
+        FileStats gone;
+        std::unordered_map<std::string, std::unique_ptr<DirListing>> kept;
+        for (size_t i = 0; i < old_entries.size(); ++i) {
+            count_entry(old_entries[i], gone);
+            if (!old_subdirs[i]) continue;
+            if (old_subdirs[i]->watch >= 0) {
+                kept.emplace(std::move(old_entries[i].name), std::move(old_subdirs[i]));
+            } else {
+                drop_model(*old_subdirs[i], gone);
+            }
+        }
+
+        dir.ok = false;
+        scan_dir(dir, counters, path_ids);
+
+        size_t lines = dir.entries.size();
+        for (size_t i = 0; i < dir.entries.size(); ++i) {
+            if (!dir.subdirs[i]) continue;
+            auto it = kept.find(dir.entries[i].name);
+            if (it != kept.end()) {
+                dir.subdirs[i] = std::move(it->second);
+                kept.erase(it);
+            } else {
+                load_model(*dir.subdirs[i], nullptr);
+            }
+            lines += dir.subdirs[i]->lines;
+        }
+        for (auto& item : kept) drop_model(*item.second, gone);
+        counters.stats.subtract(gone);
+
+        size_t old_lines = dir.lines;
+        for (DirListing* p = &dir; p; p = p->parent) p->lines = p->lines - old_lines + lines;
+    }
+
+    // Frame line of the first entry of `dir`; line 0 is the root.
+    size_t first_line(const DirListing& dir) {
+        size_t line = 1;
+        const DirListing* child = &dir;
+        for (const DirListing* p = dir.parent; p; child = p, p = p->parent) {
+            for (const auto& sub : p->subdirs) {
+                line++;
+                if (sub.get() == child) break;
+                if (sub) line += sub->lines;
+            }
+        }
+        return line;
+    }
+
+    // Renders the entries under `dir` exactly as print_tree() would.
+    void render_model(const DirListing& dir) {
+        for (size_t i = 0; i < dir.entries.size(); ++i) {
+            bool is_last = i == dir.entries.size() - 1;
+            emit(dir.entries[i], dir.depth, is_last, nullptr);
+            if (dir.subdirs[i]) render_model(*dir.subdirs[i]);
+        }
+    }
+
+    static void split_lines(const std::string& text, std::vector<std::string>& lines) {
+        size_t start = 0;
+        for (size_t end; (end = text.find('\n', start)) != std::string::npos; start = end + 1) {
+            lines.emplace_back(text, start, end - start);
+        }
+    }
+
+    std::vector<std::string> render_block(const DirListing& dir) {
+        std::vector<const DirListing*> chain;
+        for (const DirListing* p = &dir; p->parent; p = p->parent) chain.push_back(p);
+        prefix.clear();
+        for (size_t i = chain.size(); i-- > 0;) {
+            if (chain[i]->parent->subdirs.back().get() == chain[i]) {
+                prefix += glyphs.blank;
+            } else {
+                prefix += glyphs.vertical;
+            }
+        }
+
+        prefix_levels.assign(static_cast<size_t>(dir.depth), prefix.size());
+
+        std::string text;
+        out.capture(&text);
+        render_model(dir);
+        out.capture(nullptr);
+        reset_prefix();
+
+        std::vector<std::string> lines;
+        split_lines(text, lines);
+        return lines;
+    }
+
+    void render_summary(const DirListing& root) {
+        std::string text;
+        out.capture(&text);
+        out.end_line();
+        write_summary(root);
+        out.end_line();
+        out.capture(nullptr);
+        summary.clear();
+        split_lines(text, summary);
+    }
+
+    static size_t terminal_rows() {
+        struct winsize size;
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_row > 0) return size.ws_row;
+        return 24;
+    }
+
+    // Brings the screen up to date. On a terminal only the rows in `changed`
+    // and everything from `shifted` down are rewritten, and only as far as
+    // the screen reaches; otherwise the whole frame is printed again.
+    void draw(const std::vector<size_t>& changed, size_t shifted, bool clear) {
+        if (!isatty(STDOUT_FILENO)) {
+            for (const auto& line : frame) {
+                out.write(line);
+                out.write("\n", 1);
+            }
+            for (const auto& line : summary) {
+                out.write(line);
+                out.write("\n", 1);
+            }
+            out.flush();
+            return;
+        }
+
+        size_t rows = terminal_rows();
+        size_t visible = std::min(frame.size(), rows > summary.size() ? rows - summary.size() : 0);
+        auto put = [&](size_t row, const std::string& line) {
+            char move[32];
+            int len = snprintf(move, sizeof(move), "\033[%zu;1H", row + 1);
+            out.write(move, static_cast<size_t>(len));
+            out.write(line);
+            out.write("\033[K", 3);
+        };
+
+        if (clear) out.write("\033[H\033[2J", 7);
+        for (size_t row : changed) {
+            if (row < visible && row < shifted) put(row, frame[row]);
+        }
+        for (size_t row = shifted; row < visible; ++row) put(row, frame[row]);
+        for (size_t i = 0; i < summary.size(); ++i) put(visible + i, summary[i]);
+        out.write("\033[J", 3);
+        out.flush();
+    }
+
+    void redraw_all(const DirListing& root) {
+        std::string text;
+        out.capture(&text);
+        write_root_line();
+        out.end_line();
+        out.capture(nullptr);
+        frame.clear();
+        split_lines(text, frame);
+        std::vector<std::string> lines = render_block(root);
+        frame.insert(frame.end(), std::make_move_iterator(lines.begin()),
+                     std::make_move_iterator(lines.end()));
+        render_summary(root);
+        draw({}, 0, true);
+    }
+
+    void build_model(DirListing& root) {
+        if (opts.threads <= 1) {
+            load_model(root, nullptr);
+            return;
+        }
+        WalkerPool pool(*this, static_cast<size_t>(opts.threads));
+        pool.start(root);
+        load_model(root, &pool);
+        pool.finish(counters);
+    }
+
+    // Applies one batch of events. Directories are patched parents first, and
+    // each watch is looked up again at its turn because patching a parent
+    // may have dropped it. Blocks are the changed directories that have no
+    // changed ancestor; their lines are spliced into the frame in order.
+    void apply_events(std::unordered_set<int>& changed_watches, DirListing& root) {
+        struct Change {
+            int depth;
+            int wd;
+        };
+        std::vector<Change> changes;
+        std::unordered_set<const DirListing*> changed;
+        for (int wd : changed_watches) {
+            auto it = watched.find(wd);
+            if (it == watched.end()) continue;
+            changes.push_back({it->second.front()->depth, wd});
+            for (DirListing* dir : it->second) changed.insert(dir);
+        }
+        if (changes.empty()) return;
+
+        struct Block {
+            DirListing* dir;
+            size_t old_lines;
+            size_t start;
+        };
+        std::vector<Block> blocks;
+        for (const DirListing* dir : changed) {
+            bool nested = false;
+            for (const DirListing* p = dir->parent; p && !nested; p = p->parent) nested = changed.count(p);
+            if (!nested) blocks.push_back({const_cast<DirListing*>(dir), dir->lines, 0});
+        }
+
+        std::sort(changes.begin(), changes.end(),
+                  [](const Change& a, const Change& b) { return a.depth < b.depth; });
+        for (const Change& change : changes) {
+            auto it = watched.find(change.wd);
+            if (it == watched.end()) continue;
+            std::vector<DirListing*> dirs = it->second;
+            for (DirListing* dir : dirs) patch_model(*dir);
+        }
+
+        for (Block& block : blocks) block.start = first_line(*block.dir);
+        std::sort(blocks.begin(), blocks.end(),
+                  [](const Block& a, const Block& b) { return a.start < b.start; });
+
+        std::vector<size_t> rows;
+        size_t shifted = SIZE_MAX;
+        for (const Block& block : blocks) {
+            std::vector<std::string> lines = render_block(*block.dir);
+            auto at = frame.begin() + static_cast<ptrdiff_t>(block.start);
+            if (lines.size() == block.old_lines) {
+                for (size_t i = 0; i < lines.size(); ++i) {
+                    if (at[static_cast<ptrdiff_t>(i)] == lines[i]) continue;
+                    at[static_cast<ptrdiff_t>(i)] = std::move(lines[i]);
+                    rows.push_back(block.start + i);
+                }
+                continue;
+            }
+            shifted = std::min(shifted, block.start);
+            at = frame.erase(at, at + static_cast<ptrdiff_t>(block.old_lines));
+            frame.insert(at, std::make_move_iterator(lines.begin()),
+                         std::make_move_iterator(lines.end()));
+        }
+        render_summary(root);
+        draw(rows, shifted, false);
+    }
+
+    [[noreturn]] void watch_tree() {
+        inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+        if (inotify_fd < 0) {
+            std::cerr << "Error: inotify: " << std::strerror(errno) << std::endl;
+            exit(1);
+        }
+
+        auto root = std::make_unique<DirListing>();
+        root->name = opts.target_dir;
+        identify_root(*root);
+        build_model(*root);
+        redraw_all(*root);
+
+        // Events are read until the queue has been quiet for 50ms, or for at
+        // most 500ms, so a burst of changes costs one batch.
+        alignas(struct inotify_event) char buffer[1 << 16];
+        struct pollfd wait = {inotify_fd, POLLIN, 0};
+        for (;;) {
+            if (poll(&wait, 1, -1) < 0 && errno != EINTR) exit(1);
+            std::unordered_set<int> changed_watches;
+            bool overflow = false;
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(500);
+            do {
+                ssize_t len;
+                while ((len = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+                    for (char* p = buffer; p < buffer + len;) {
+                        auto* event = reinterpret_cast<struct inotify_event*>(p);
+                        if (event->mask & IN_Q_OVERFLOW) {
+                            overflow = true;
+                        } else if (event->mask & IN_IGNORED) {
+                            forget_watch(event->wd);
+                        } else {
+                            changed_watches.insert(event->wd);
+                        }
+                        p += sizeof(struct inotify_event) + event->len;
+                    }
+                }
+            } while (std::chrono::steady_clock::now() < deadline && poll(&wait, 1, 50) > 0);
+
+            if (overflow) {
+                // Events were lost: start over from a fresh walk.
+                for (auto& item : watched) inotify_rm_watch(inotify_fd, item.first);
+                watched.clear();
+                counters.stats = FileStats();
+                root = std::make_unique<DirListing>();
+                root->name = opts.target_dir;
+                identify_root(*root);
+                build_model(*root);
+                redraw_all(*root);
+                continue;
+            }
+            apply_events(changed_watches, *root);
+        }
+    }
+
+    // Scans the tree under target_dir breadth-first, ignoring every display
+    // filter, and writes it as a snapshot. -D is applied when the snapshot is
+    // rendered: -P, -S and --du decide what to show from the entries below
+    // it, so the scan always goes to the bottom. Each directory's
+    // children are appended as one contiguous, name-sorted run, which is
+    // what gives the child-offset index its shape.
+    bool save_snapshot(const std::string& file, std::string& error) {
+        std::vector<SnapshotNode> nodes;
+        std::string strings;
+
+        auto make_node = [&](const Entry& entry) { return to_node(entry, strings); };
+
+        Entry root;
+        root.name = opts.target_dir;
+        root.type = DT_UNKNOWN;
+        load_entry(AT_FDCWD, root, counters.sys_stats, true);
+        if (root.is_symlink) read_link(AT_FDCWD, root, counters.sys_stats);
+        nodes.push_back(make_node(root));
+
+        // Parent of every node, for the -L cycle check while saving.
+        std::vector<uint32_t> parents(1, 0);
+        auto on_saved_path = [&](uint32_t node, uint64_t dev, uint64_t inode) {
+            for (;;) {
+                const SnapshotNode& n = nodes[node];
+                if ((n.flags & SNAP_HAS_STAT) && n.dev == dev && n.inode == inode) return true;
+                if (node == 0) return false;
+                node = parents[node];
+            }
+        };
+
+        struct Pending {
+            uint32_t node;
+            std::string path;
+            int depth;
+        };
+        std::deque<Pending> queue;
+        queue.push_back({0, opts.target_dir, 1});
+
+        while (!queue.empty()) {
+            Pending dir = std::move(queue.front());
+            queue.pop_front();
+
+            DIR* handle = opendir(dir.path.c_str());
+            if (!handle) {
+                nodes[dir.node].flags |= SNAP_UNREADABLE;
+                continue;
+            }
+            counters.sys_stats.dirs_opened++;
+
+            std::vector<Entry> entries;
+            while (struct dirent* de = readdir(handle)) {
+                const char* name = de->d_name;
+                if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                    continue;
+                }
+                counters.sys_stats.entries++;
+                Entry entry;
+                entry.name = name;
+                entry.type = de->d_type;
+                load_entry(dirfd(handle), entry, counters.sys_stats, true);
+                if (entry.is_symlink) read_link(dirfd(handle), entry, counters.sys_stats);
+                entries.push_back(std::move(entry));
+            }
+            closedir(handle);
+            sort_entries(entries, counters.sys_stats.clock);
+
+            if (nodes.size() + entries.size() > UINT32_MAX || strings.size() > UINT32_MAX) {
+                error = "tree too large for the snapshot format";
+                return false;
+            }
+            nodes[dir.node].first_child = static_cast<uint32_t>(nodes.size());
+            nodes[dir.node].child_count = static_cast<uint32_t>(entries.size());
+            for (const auto& entry : entries) {
+                uint32_t index = static_cast<uint32_t>(nodes.size());
+                nodes.push_back(make_node(entry));
+                parents.push_back(dir.node);
+
+                bool descend = entry.is_dir;
+                if (descend && entry.is_symlink && !opts.follow_symlinks) descend = false;
+                if (descend && entry.has_stat) {
+                    if (opts.one_filesystem && entry.dev != root.dev) descend = false;
+                    if (opts.follow_symlinks && on_saved_path(dir.node, entry.dev, entry.inode)) {
+                        descend = false;
+                    }
+                }
+                if (descend) {
+                    std::string path = dir.path;
+                    append_path(path, entry.name);
+                    queue.push_back({index, std::move(path), dir.depth + 1});
+                }
+            }
+        }
+
+        SnapshotHeader header{};
+        std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        header.version = SNAPSHOT_VERSION;
+        header.node_count = static_cast<uint32_t>(nodes.size());
+        header.nodes_offset = sizeof(SnapshotHeader);
+        header.strings_offset = header.nodes_offset + nodes.size() * sizeof(SnapshotNode);
+        header.strings_size = strings.size();
+
+        std::ofstream stream(file, std::ios::binary | std::ios::trunc);
+        stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        stream.write(reinterpret_cast<const char*>(nodes.data()),
+                     static_cast<std::streamsize>(nodes.size() * sizeof(SnapshotNode)));
+        stream.write(strings.data(), static_cast<std::streamsize>(strings.size()));
+        stream.close();
+        if (!stream) {
+            error = "could not write " + file;
+            return false;
+        }
+        return true;
+    }
+
+    bool load_snapshot(const std::string& file) {
+        snapshot = std::make_unique<Snapshot>();
+        std::string error;
+        if (!snapshot->open(file, error)) {
+            std::cerr << "Error: cannot read snapshot " << file << ": " << error << std::endl;
+            return false;
+        }
+        const SnapshotNode& root = snapshot->node(0);
+        std::string_view name = snapshot->name(root);
+        opts.target_dir.assign(name.data(), name.size());
+        return true;
+    }
+
+    void compile_patterns() {
+        for (const auto& pattern : opts.patterns) {
+            GlobSet::Kind kind = GlobSet::Kind::Substring;
+            bool icase = opts.ignore_case;
+            if (opts.exact_match) {
+                kind = GlobSet::Kind::Exact;
+            } else if (pattern.find_first_of("*?[") != std::string::npos) {
+                // Wildcard patterns have always been case-insensitive.
+                kind = GlobSet::Kind::Glob;
+                icase = !opts.match_case;
+            }
+            globs.add(pattern, kind, icase, false);
+        }
+        for (const auto& pattern : opts.exclude_patterns) {
+            globs.add(pattern, GlobSet::Kind::Glob, opts.ignore_case, true);
+        }
+        globs.compile();
+    }
+
+public:
+    TreePrinter(const Options& options) 
+        : opts(options), 
+          dir_fds(fd_budget(options) - (options.unsorted ? stream_budget(options) : 0)),
+          glyphs(GLYPHS[options.use_ascii]),
+          renderer(renderer_for(options)),
+          visibility(select_filter(filter_features(options),
+                                   std::make_integer_sequence<unsigned, FILTER_COMBINATIONS>())) {
+        setup_console();
+        compile_patterns();
+        if (opts.profile) {
+            started_ns = PhaseClock::now_ns();
+            counters.sys_stats.clock.enabled = true;
+            out.profile(&counters.sys_stats.clock);
+        }
+    }
+
+    void visit(const EntryRecord& record) override { (this->*renderer)(record); }
+
+    // Library entry point: walks target_dir with every filter applied and
+    // hands each visible entry to `consumer` in display order, writing
+    // nothing to stdout. Snapshots given with --fromfile are read; --save,
+    // --cache, --du-top and --watch belong to the command line and are
+    // ignored. Returns false if the snapshot cannot be loaded.
+    bool visit_tree(EntryVisitor& consumer) {
+        if (!opts.from_file.empty() && !snapshot && !load_snapshot(opts.from_file)) return false;
+
+        // Each visit counts from zero, hard links charged to --du included.
+        bool profiling = counters.sys_stats.clock.enabled;
+        counters = WalkCounters();
+        counters.sys_stats.clock.enabled = profiling;
+        du_seen.clear();
+
+        // --du-top would resolve the tree without keeping any entries; the
+        // visitor gets them all, so it is off for this walk.
+        size_t du_top = std::exchange(opts.du_top, 0);
+        visitor = &consumer;
+        auto root = std::make_unique<DirListing>();
+        root->name = opts.target_dir;
+        identify_root(*root);
+        if (opts.du) charge_root(*root);
+        try {
+            walk(*root);
+        } catch (...) {
+            visitor = this;
+            opts.du_top = du_top;
+            throw;
+        }
+        visitor = this;
+        opts.du_top = du_top;
+        return true;
+    }
+
+    // Totals of the last visit_tree(), as on the summary line.
+    const FileStats& stats() const { return counters.stats; }
+
+    void print_sys_stats() {
+        double per_entry = counters.sys_stats.entries
+            ? static_cast<double>(counters.sys_stats.stat_calls) / counters.sys_stats.entries : 0.0;
+        char ratio[32];
+        snprintf(ratio, sizeof(ratio), "%.2f", per_entry);
+        std::cerr << counters.sys_stats.entries << " entries read, "
+                  << counters.sys_stats.dirs_opened << " directories opened, "
+                  << counters.sys_stats.stat_calls << " stat calls (" << ratio << " per entry), "
+                  << counters.sys_stats.readlink_calls << " readlink calls" << std::endl;
+    }
+
+    // Writes the --cache file back and reports how much of the scan it saved.
+    void finish_cache() {
+        if (!cache) return;
+        std::string error;
+        if (!cache->save(error)) std::cerr << "Warning: " << error << std::endl;
+
+        uint64_t lookups = cache->hits() + cache->misses();
+        char rate[32];
+        snprintf(rate, sizeof(rate), "%.1f", lookups ? 100.0 * cache->hits() / lookups : 0.0);
+        std::cerr << "cache: " << cache->hits() << " of " << lookups
+                  << " directories reused (" << rate << "% hit rate)" << std::endl;
+    }
+
+    // --profile report: one JSON object on stderr. Phase times are summed
+    // over all threads, so under -j they can add up to more than wall_ms.
+    void print_profile() {
+        out.flush();
+        const PhaseClock& clock = counters.sys_stats.clock;
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+
+        char number[32];
+        auto ms = [&](uint64_t ns) {
+            snprintf(number, sizeof(number), "%.3f", static_cast<double>(ns) / 1e6);
+            return number;
+        };
+        std::cerr << "{\"wall_ms\":" << ms(PhaseClock::now_ns() - started_ns)
+                  << ",\"threads\":" << std::max(opts.threads, 1) << ",\"phases_ms\":{";
+        for (size_t i = 0; i < PHASE_COUNT; ++i) {
+            std::cerr << (i ? "," : "") << '"' << PHASE_NAMES[i] << "\":" << ms(clock.ns[i]);
+        }
+        std::cerr << "},\"entries\":" << counters.sys_stats.entries
+                  << ",\"dirs_opened\":" << counters.sys_stats.dirs_opened
+                  << ",\"dirs_reopened\":" << counters.sys_stats.dirs_reopened
+                  << ",\"stat_calls\":" << counters.sys_stats.stat_calls
+                  << ",\"readlink_calls\":" << counters.sys_stats.readlink_calls
+                  << ",\"bytes_written\":" << out.bytes_written()
+                  << ",\"node_store_peak_nodes\":" << store_usage.peak_nodes
+                  << ",\"node_store_peak_bytes\":" << store_usage.peak_bytes
+                  << ",\"peak_rss_kb\":" << usage.ru_maxrss << "}" << std::endl;
+    }
+
+    void print() {
+        if (!opts.save_file.empty()) {
+            std::string error;
+            if (!save_snapshot(opts.save_file, error)) {
+                std::cerr << "Error: " << error << std::endl;
+                exit(1);
+            }
+            // Render from what was just written so both paths stay identical.
+            opts.from_file = opts.save_file;
+        }
+        if (!opts.from_file.empty() && !load_snapshot(opts.from_file)) {
+            exit(1);
+        }
+        if (!opts.cache_dir.empty() && !snapshot) {
+            cache = std::make_unique<ScanCache>();
+            std::string error;
+            if (!cache->load(opts.cache_dir, error)) {
+                std::cerr << "Error: " << error << std::endl;
+                exit(1);
+            }
+        }
+
+        try {
+            if (opts.du_top) {
+                DirListing root;
+                root.name = opts.target_dir;
+                identify_root(root);
+                charge_root(root);
+                print_du_top(root);
+                out.end_line();
+                write_du_total(root);
+                out.end_line();
+                out.flush();
+                finish_cache();
+                if (opts.verbose) print_sys_stats();
+                if (opts.profile) print_profile();
+                return;
+            }
+
+            if (opts.watch) {
+                watch_tree();
+                return;
+            }
+
+            if (opts.count_only) {
+                DirListing root;
+                root.name = opts.target_dir;
+                if (counts_from_dirents()) {
+                    count_tree(root);
+                } else {
+                    struct : EntryVisitor {
+                        void visit(const EntryRecord&) override {}
+                    } discard;
+                    visitor = &discard;
+                    identify_root(root);
+                    if (opts.du) charge_root(root);
+                    walk(root);
+                    visitor = this;
+                }
+                write_summary(root);
+                out.end_line();
+                out.flush();
+                finish_cache();
+                if (opts.verbose) print_sys_stats();
+                if (opts.profile) print_profile();
+                return;
+            }
+
+            if (opts.dupes) dupes = std::make_unique<DupeFinder>();
+
+            bool json = opts.format != OutputFormat::Tree;
+            if (json) {
+                begin_json();
+            } else {
+                write_root_line();
+                out.end_line();
+            }
+
+            auto root = std::make_unique<DirListing>();
+            root->name = opts.target_dir;
+            identify_root(*root);
+            if (opts.du) charge_root(*root);
+            walk(*root);
+
+            if (json) {
+                end_json();
+            } else {
+                out.end_line();
+                write_summary(*root);
+                out.end_line();
+            }
+            out.flush();
+            finish_cache();
+
+            if (opts.verbose) {
+                print_sys_stats();
+            }
+            if (opts.profile) print_profile();
+
+        } catch (const fs::filesystem_error& e) {
+            out.flush();
+            std::cerr << "Error: " << e.what() << std::endl;
+            exit(1);
+        } catch (const std::length_error& e) {
+            out.flush();
+            std::cerr << "Error: " << e.what() << std::endl;
+            exit(1);
+        }
+    }
+
+    void write_root_line() {
+        out.write(opts.target_dir);
+        fs::path root_path = fs::path(opts.target_dir);
+        if (snapshot) {
+            const SnapshotNode& node = snapshot->node(0);
+            if (node.flags & SNAP_IS_SYMLINK) {
+                std::string_view target = snapshot->target(node);
+                out.write(" -> ", 4);
+                out.write(target.data(), target.size());
+            }
+        } else if (fs::is_symlink(root_path)) {
+            out.write(" -> ", 4);
+            out.write(fs::read_symlink(root_path).string());
+        }
+    }
+
+    void write_summary(const DirListing& root) {
+        out.write_number(counters.stats.directories);
+        out.write(" directories");
+        if (!opts.dirs_only) {
+            out.write(", ");
+            out.write_number(counters.stats.files);
+            out.write(" files");
+        }
+        if (counters.stats.symlinks > 0) {
+            out.write(", ");
+            out.write_number(counters.stats.symlinks);
+            out.write(" symlinks");
+        }
+        if (counters.stats.executables > 0) {
+            out.write(", ");
+            out.write_number(counters.stats.executables);
+            out.write(" executables");
+        }
+        if (opts.size_filter) {
+            out.write(", ");
+            out.write_number(counters.stats.size_filtered_files);
+            out.write(" size-filtered files (");
+            out.write(format_size(opts.min_size));
+            out.write(" - ");
+            out.write(format_size(opts.max_size));
+            out.write(")");
+        }
+        if (opts.show_size || opts.size_filter) {
+            out.write("\nTotal size: ");
+            out.write(format_size(counters.stats.total_size));
+        }
+        if (opts.du) {
+            out.end_line();
+            write_du_total(root);
+        }
+        if (dupes) {
+            out.write("\nDuplicates: ");
+            out.write(format_size(dupes->reclaimable()));
+            out.write(" reclaimable in ");
+            out.write_number(dupes->groups());
+            out.write(dupes->groups() == 1 ? " group of " : " groups of ");
+            out.write_number(dupes->files_in_groups());
+            out.write(" files");
+        }
+    }
+};
+
+} // namespace tree_walker
+
+#endif // TREE_WALKER_H